@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "config.h"
+
+void config_init(Config *config) {
+    config->max_fps = 0;
+    // The grey we have always filled the background with when there's no wallpaper
+    config->background[0] = config->background[1] = config->background[2] = 0x8080;
+    config->window_opacity = true;
+    config->unredirect = UNREDIRECT_NEVER;
+    config->backend = BACKEND_XRENDER;
+    config->blur_passes = 2;
+    config->corner_radius = 0;
+    config->adaptive_quality = true;
+    config->vsync = true;
+    config->debug_paint = DEBUG_PAINT_OFF;
+    config->export_socket = NULL;
+    config->thumbnail_socket = NULL;
+    config->thumbnail_size = 256;
+    config->thumbnail_rate = 2;
+    config->memory_budget = 256;
+    config->rules = NULL;
+}
+
+
+void config_free(Config *config) {
+    for (size_t i = 0; i < cvector_size(config->rules); ++i)
+        free(config->rules[i].class_name);
+    cvector_free(config->rules);
+    config->rules = NULL;
+    free(config->export_socket);
+    config->export_socket = NULL;
+    free(config->thumbnail_socket);
+    config->thumbnail_socket = NULL;
+}
+
+
+char *config_default_path(void) {
+    const char *base = getenv("XDG_CONFIG_HOME");
+    const char *suffix = "/compositor/compositor.conf";
+    char *path;
+
+    if (base && *base) {
+        path = malloc(strlen(base) + strlen(suffix) + 1);
+        sprintf(path, "%s%s", base, suffix);
+    } else {
+        const char *home = getenv("HOME");
+        if (!home)
+            home = ".";
+        path = malloc(strlen(home) + strlen("/.config") + strlen(suffix) + 1);
+        sprintf(path, "%s/.config%s", home, suffix);
+    }
+    return path;
+}
+
+
+static char *trim(char *s) {
+    while (isspace((unsigned char) *s))
+        s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+
+static bool parse_bool(const char *value, bool *out) {
+    if (!strcmp(value, "true") || !strcmp(value, "yes") || !strcmp(value, "1")) {
+        *out = true;
+        return true;
+    }
+    if (!strcmp(value, "false") || !strcmp(value, "no") || !strcmp(value, "0")) {
+        *out = false;
+        return true;
+    }
+    return false;
+}
+
+
+static bool parse_int(const char *value, int min, int max, int *out) {
+    char *end;
+    long v = strtol(value, &end, 10);
+    if (end == value || *end || v < min || v > max)
+        return false;
+    *out = v;
+    return true;
+}
+
+
+static bool parse_double(const char *value, double min, double max, double *out) {
+    char *end;
+    double v = strtod(value, &end);
+    if (end == value || *end || v < min || v > max)
+        return false;
+    *out = v;
+    return true;
+}
+
+
+// #rrggbb
+static bool parse_color(const char *value, unsigned short rgb[3]) {
+    char *end;
+    if (value[0] != '#' || strlen(value) != 7)
+        return false;
+    unsigned long v = strtoul(value + 1, &end, 16);
+    if (*end)
+        return false;
+    for (int i = 0; i < 3; i++) {
+        unsigned short c = (v >> (16 - 8 * i)) & 0xff;
+        rgb[i] = c << 8 | c;
+    }
+    return true;
+}
+
+
+// <class> [key=value ...]
+static bool parse_rule(char *value, Window_Rule *rule) {
+    char *save;
+    char *token = strtok_r(value, " \t", &save);
+    if (!token)
+        return false;
+
+    rule->class_name = NULL;
+    rule->opacity = -1;
+    rule->blur = -1;
+    rule->corner_radius = -1;
+
+    while ((token = strtok_r(NULL, " \t", &save))) {
+        if (!strncmp(token, "opacity=", 8)) {
+            if (!parse_double(token + 8, 0, 1, &rule->opacity))
+                return false;
+        } else if (!strncmp(token, "blur=", 5)) {
+            bool blur;
+            if (!parse_bool(token + 5, &blur))
+                return false;
+            rule->blur = blur;
+        } else if (!strncmp(token, "corner_radius=", 14)) {
+            if (!parse_int(token + 14, 0, MAX_CORNER_RADIUS, &rule->corner_radius))
+                return false;
+        } else {
+            return false;
+        }
+    }
+
+    rule->class_name = strdup(value);
+    return true;
+}
+
+
+bool config_load(Config *config, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+
+        // Comments take up a whole line, since colours start with '#' too
+        char *key = trim(line);
+        if (!*key || *key == '#')
+            continue;
+
+        char *equals = strchr(key, '=');
+        if (!equals) {
+            fprintf(stderr, "%s:%d: expected 'key = value'\n", path, line_number);
+            continue;
+        }
+        *equals = '\0';
+        char *value = trim(equals + 1);
+        key = trim(key);
+
+        bool ok;
+        if (!strcmp(key, "max_fps")) {
+            ok = parse_int(value, 0, 1000, &config->max_fps);
+        } else if (!strcmp(key, "background")) {
+            ok = parse_color(value, config->background);
+        } else if (!strcmp(key, "window_opacity")) {
+            ok = parse_bool(value, &config->window_opacity);
+        } else if (!strcmp(key, "unredirect")) {
+            ok = true;
+            if (!strcmp(value, "never"))
+                config->unredirect = UNREDIRECT_NEVER;
+            else if (!strcmp(value, "fullscreen"))
+                config->unredirect = UNREDIRECT_FULLSCREEN;
+            else
+                ok = false;
+        } else if (!strcmp(key, "debug_paint")) {
+            ok = true;
+            if (!strcmp(value, "off"))
+                config->debug_paint = DEBUG_PAINT_OFF;
+            else if (!strcmp(value, "damage"))
+                config->debug_paint = DEBUG_PAINT_DAMAGE;
+            else if (!strcmp(value, "overdraw"))
+                config->debug_paint = DEBUG_PAINT_OVERDRAW;
+            else
+                ok = false;
+        } else if (!strcmp(key, "backend")) {
+            ok = true;
+            if (!strcmp(value, "xrender"))
+                config->backend = BACKEND_XRENDER;
+            else if (!strcmp(value, "software"))
+                config->backend = BACKEND_SOFTWARE;
+            else if (!strcmp(value, "glx"))
+                config->backend = BACKEND_GLX;
+            else
+                ok = false;
+        } else if (!strcmp(key, "export_socket")) {
+            ok = *value != '\0';
+            if (ok) {
+                free(config->export_socket);
+                config->export_socket = strdup(value);
+            }
+        } else if (!strcmp(key, "thumbnail_socket")) {
+            ok = *value != '\0';
+            if (ok) {
+                free(config->thumbnail_socket);
+                config->thumbnail_socket = strdup(value);
+            }
+        } else if (!strcmp(key, "thumbnail_size")) {
+            ok = parse_int(value, 16, 1024, &config->thumbnail_size);
+        } else if (!strcmp(key, "thumbnail_rate")) {
+            ok = parse_int(value, 1, 60, &config->thumbnail_rate);
+        } else if (!strcmp(key, "memory_budget")) {
+            ok = parse_int(value, 0, 1 << 20, &config->memory_budget);
+        } else if (!strcmp(key, "vsync")) {
+            ok = parse_bool(value, &config->vsync);
+        } else if (!strcmp(key, "blur_passes")) {
+            ok = parse_int(value, 1, MAX_BLUR_PASSES, &config->blur_passes);
+        } else if (!strcmp(key, "corner_radius")) {
+            ok = parse_int(value, 0, MAX_CORNER_RADIUS, &config->corner_radius);
+        } else if (!strcmp(key, "adaptive_quality")) {
+            ok = parse_bool(value, &config->adaptive_quality);
+        } else if (!strcmp(key, "rule")) {
+            Window_Rule rule;
+            ok = parse_rule(value, &rule);
+            if (ok)
+                cvector_push_back(config->rules, rule);
+        } else {
+            fprintf(stderr, "%s:%d: unknown option '%s'\n", path, line_number, key);
+            continue;
+        }
+
+        if (!ok)
+            fprintf(stderr, "%s:%d: bad value '%s' for '%s'\n", path, line_number, value, key);
+    }
+
+    fclose(file);
+    return true;
+}
+
+
+bool config_rules_equal(const Config *a, const Config *b) {
+    if (cvector_size(a->rules) != cvector_size(b->rules))
+        return false;
+    for (size_t i = 0; i < cvector_size(a->rules); ++i) {
+        const Window_Rule *ra = &a->rules[i];
+        const Window_Rule *rb = &b->rules[i];
+        if (strcmp(ra->class_name, rb->class_name) || ra->opacity != rb->opacity ||
+            ra->blur != rb->blur || ra->corner_radius != rb->corner_radius)
+            return false;
+    }
+    return true;
+}
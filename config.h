@@ -0,0 +1,73 @@
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#include <stdbool.h>
+
+#include "cvector.h"
+
+enum Backend {
+    BACKEND_XRENDER = 0,
+    BACKEND_SOFTWARE = 1,   // composites on our own threads, for servers without acceleration
+    BACKEND_GLX = 2,
+};
+
+// What to do with a solid window that covers the whole screen
+enum Unredirect_Policy {
+    UNREDIRECT_NEVER = 0,
+    UNREDIRECT_FULLSCREEN = 1,
+};
+
+// What's drawn over each frame to show how it was painted, xrender only
+enum Debug_Paint {
+    DEBUG_PAINT_OFF = 0,
+    DEBUG_PAINT_DAMAGE = 1,     // tint the repainted region, a new colour every frame
+    DEBUG_PAINT_OVERDRAW = 2,   // redder the more composites touched a pixel
+};
+
+#define MAX_BLUR_PASSES 5
+#define MAX_CORNER_RADIUS 64
+
+// `rule = <class> opacity=<0..1> blur=<bool> corner_radius=<px>` in the config
+// file. The class is matched against both the instance and the class part of
+// WM_CLASS.
+typedef struct Window_Rule {
+    char *class_name;
+    double opacity;     // < 0 when the rule doesn't set it
+    int blur;           // blur what's behind the window, < 0 when not set
+    int corner_radius;  // < 0 when not set
+} Window_Rule;
+
+typedef struct Config {
+    int max_fps;                        // 0 means paint at the output's refresh rate
+    unsigned short background[3];       // r, g, b used when no wallpaper is set
+    bool window_opacity;                // honour _NET_WM_WINDOW_OPACITY
+    enum Unredirect_Policy unredirect;
+    enum Backend backend;               // only read at startup
+    int blur_passes;                    // halvings of the background blur
+    int corner_radius;                  // of every window's corners, 0 for square
+    bool adaptive_quality;              // turn effects down when frames take too long
+    bool vsync;                         // present frames at vblank, only read at startup
+    enum Debug_Paint debug_paint;       // SIGUSR2 cycles through them at runtime
+    char *export_socket;                // where frames are published, NULL if not
+    char *thumbnail_socket;             // where thumbnails are served, NULL if not
+    int thumbnail_size;                 // thumbnails fit in a square this big
+    int thumbnail_rate;                 // most thumbnails of one window a second
+    int memory_budget;                  // MiB of caches kept for hidden windows, 0 for no limit
+    cvector(Window_Rule) rules;
+} Config;
+
+void config_init(Config *config);
+void config_free(Config *config);
+
+// Reads `path` into `config`, which should be freshly initialized. Problems
+// are reported on stderr with their line number and the offending line is
+// skipped. Returns false if the file couldn't be opened.
+bool config_load(Config *config, const char *path);
+
+// $XDG_CONFIG_HOME/compositor/compositor.conf, falling back to ~/.config.
+// The result is malloc'ed.
+char *config_default_path(void);
+
+bool config_rules_equal(const Config *a, const Config *b);
+
+#endif /* CONFIG_H_ */
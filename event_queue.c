@@ -0,0 +1,57 @@
+#include <stdlib.h>
+
+#include "event_queue.h"
+
+bool event_queue_init(Event_Queue *queue, size_t capacity) {
+    size_t rounded = 1;
+    while (rounded < capacity)
+        rounded <<= 1;
+
+    queue->events = malloc(sizeof(XEvent) * rounded);
+    if (!queue->events)
+        return false;
+    queue->capacity = rounded;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->high_water, 0);
+    atomic_init(&queue->stalls, 0);
+    return true;
+}
+
+
+bool event_queue_push(Event_Queue *queue, const XEvent *event) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head == queue->capacity)
+        return false;
+
+    queue->events[tail & (queue->capacity - 1)] = *event;
+    // Publishes the event to the consumer
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    if (tail + 1 - head > atomic_load_explicit(&queue->high_water, memory_order_relaxed))
+        atomic_store_explicit(&queue->high_water, tail + 1 - head, memory_order_relaxed);
+    return true;
+}
+
+
+bool event_queue_pop(Event_Queue *queue, XEvent *event) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head == tail)
+        return false;
+
+    *event = queue->events[head & (queue->capacity - 1)];
+    // Hands the slot back to the producer
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+
+size_t event_queue_depth(Event_Queue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    return tail - head;
+}
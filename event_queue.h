@@ -0,0 +1,34 @@
+#ifndef EVENT_QUEUE_H_
+#define EVENT_QUEUE_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <X11/Xlib.h>
+
+/*
+ * A bounded single-producer single-consumer ring of XEvents. The ingest
+ * thread pushes, the render thread pops, and neither ever takes a lock.
+ * head and tail only ever grow and are masked into the ring, so their
+ * difference is the number of queued events.
+ */
+typedef struct Event_Queue {
+    _Alignas(64) atomic_size_t head;    // next event to pop, written by the consumer
+    _Alignas(64) atomic_size_t tail;    // next free slot, written by the producer
+    atomic_size_t high_water;           // deepest the queue has been
+    atomic_ulong stalls;                // times the producer found the queue full
+    _Alignas(64) size_t capacity;       // a power of two
+    XEvent *events;
+} Event_Queue;
+
+bool event_queue_init(Event_Queue *queue, size_t capacity);
+
+// Producer side. Returns false if the queue is full.
+bool event_queue_push(Event_Queue *queue, const XEvent *event);
+
+// Consumer side. Returns false if the queue is empty.
+bool event_queue_pop(Event_Queue *queue, XEvent *event);
+
+size_t event_queue_depth(Event_Queue *queue);
+
+#endif /* EVENT_QUEUE_H_ */
@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <X11/Xlib-xcb.h>
+
+#include "cvector.h"
+#include "frame_export.h"
+#include "shared_memory.h"
+
+static Display *display;
+static xcb_connection_t *connection;
+static int listen_fd = -1;
+static cvector(int) consumers = NULL;
+
+// The ring, while anyone is attached
+static int ring_fd = -1;
+static size_t ring_size;
+static Frame_Ring *ring;
+static xcb_shm_seg_t segment;
+static uint64_t slot_frames[FRAME_EXPORT_SLOTS];   // what each slot holds, 0 if nothing yet
+
+// What changed in the last frames, newest first, to bring a slot up to date
+static cvector(XRectangle) history[FRAME_EXPORT_SLOTS];
+
+static unsigned long frames_exported;
+static unsigned long bytes_exported;
+
+
+bool frame_export_init(Display *dpy, const char *path) {
+    display = dpy;
+    connection = XGetXCBConnection(display);
+
+    listen_fd = listen_unix(path);
+    return listen_fd >= 0;
+}
+
+
+int frame_export_listen_fd(void) {
+    return listen_fd;
+}
+
+
+bool frame_export_active(void) {
+    return !cvector_empty(consumers);
+}
+
+
+static void free_ring(void) {
+    if (!ring)
+        return;
+    xcb_shm_detach(connection, segment);
+    munmap(ring, sizeof(Frame_Ring));
+    close(ring_fd);
+    ring = NULL;
+    ring_fd = -1;
+    for (int i = 0; i < FRAME_EXPORT_SLOTS; i++) {
+        slot_frames[i] = 0;
+        cvector_clear(history[i]);
+    }
+}
+
+
+static bool create_ring(int width, int height) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t header = (sizeof(Frame_Ring) + page - 1) / page * page;
+    size_t stride = (size_t) width * 4;
+    size_t frame = stride * height;
+    ring_size = header + frame * FRAME_EXPORT_SLOTS;
+
+    ring_fd = shared_memory_create("compositor-frames", ring_size);
+    if (ring_fd < 0)
+        return false;
+
+    // Only the header is ours to write, the server fills in the pixels
+    ring = mmap(NULL, sizeof(Frame_Ring), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+
+    if (!shared_memory_attach(connection, ring_fd, &segment)) {
+        fprintf(stderr, "The server can't attach the frame export memory\n");
+        munmap(ring, sizeof(Frame_Ring));
+        ring = NULL;
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+
+    Visual *visual = DefaultVisual(display, DefaultScreen(display));
+    ring->magic = FRAME_EXPORT_MAGIC;
+    ring->version = FRAME_EXPORT_VERSION;
+    ring->width = width;
+    ring->height = height;
+    ring->stride = stride;
+    ring->depth = DefaultDepth(display, DefaultScreen(display));
+    ring->red_mask = visual->red_mask;
+    ring->green_mask = visual->green_mask;
+    ring->blue_mask = visual->blue_mask;
+    ring->slot_count = FRAME_EXPORT_SLOTS;
+    atomic_store(&ring->latest, 0);
+    for (int i = 0; i < FRAME_EXPORT_SLOTS; i++) {
+        atomic_store(&ring->slots[i].sequence, 0);
+        ring->slots[i].data_offset = header + frame * i;
+        ring->slots[i].rect_count = 0;
+    }
+    return true;
+}
+
+
+bool frame_export_accept(int width, int height) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    bool created = false;
+    if (!ring) {
+        if (!create_ring(width, height)) {
+            close(fd);
+            return false;
+        }
+        created = true;
+    }
+    // The memfd's size comes along with it
+    uint64_t size = ring_size;
+    if (!send_fd(fd, ring_fd, &size, sizeof(size))) {
+        close(fd);
+        if (cvector_empty(consumers))
+            free_ring();
+        return false;
+    }
+    cvector_push_back(consumers, fd);
+    return created;
+}
+
+
+void frame_export_reset(void) {
+    for (size_t i = 0; i < cvector_size(consumers); ++i)
+        close(consumers[i]);
+    cvector_clear(consumers);
+    free_ring();
+}
+
+
+static int compare_spans(const void *a, const void *b) {
+    const int *sa = a, *sb = b;
+    return sa[0] - sb[0];
+}
+
+
+void frame_export_publish(Drawable drawable, const XRectangle *rects, int count) {
+    if (!ring || !count)
+        return;
+
+    uint64_t sequence = atomic_load_explicit(&ring->latest, memory_order_relaxed) + 1;
+    int index = sequence % FRAME_EXPORT_SLOTS;
+    Frame_Slot *slot = &ring->slots[index];
+    int width = ring->width, height = ring->height;
+
+    // This frame's rectangles, clipped to the screen. They only go into
+    // history once the frame is published, until then history[0] is still
+    // the frame before this one.
+    static cvector(XRectangle) damage = NULL;
+    cvector_clear(damage);
+    for (int i = 0; i < count; i++) {
+        int x0 = rects[i].x > 0 ? rects[i].x : 0;
+        int y0 = rects[i].y > 0 ? rects[i].y : 0;
+        int x1 = rects[i].x + rects[i].width < width ? rects[i].x + rects[i].width : width;
+        int y1 = rects[i].y + rects[i].height < height ? rects[i].y + rects[i].height : height;
+        if (x0 < x1 && y0 < y1) {
+            XRectangle r = { x0, y0, x1 - x0, y1 - y0 };
+            cvector_push_back(damage, r);
+        }
+    }
+    if (cvector_empty(damage))
+        return;
+
+    // The rows the slot is missing: everything since the frame it holds.
+    // Whole rows are fetched so they land in place in the slot's pixels.
+    static cvector(int) spans = NULL;
+    cvector_clear(spans);
+    uint64_t age = slot_frames[index] ? sequence - slot_frames[index] : 0;
+    if (age == 0 || age > FRAME_EXPORT_SLOTS) {
+        cvector_push_back(spans, 0);
+        cvector_push_back(spans, height);
+    } else {
+        for (size_t i = 0; i < cvector_size(damage); ++i) {
+            cvector_push_back(spans, damage[i].y);
+            cvector_push_back(spans, damage[i].y + damage[i].height);
+        }
+        for (uint64_t f = 0; f + 1 < age; f++) {
+            for (size_t i = 0; i < cvector_size(history[f]); ++i) {
+                cvector_push_back(spans, history[f][i].y);
+                cvector_push_back(spans, history[f][i].y + history[f][i].height);
+            }
+        }
+        qsort(spans, cvector_size(spans) / 2, sizeof(int) * 2, compare_spans);
+    }
+
+    atomic_store_explicit(&slot->sequence, 0, memory_order_release);
+    slot_frames[index] = 0;
+
+    static cvector(xcb_shm_get_image_cookie_t) cookies = NULL;
+    cvector_clear(cookies);
+    size_t span_count = cvector_size(spans) / 2;
+    for (size_t i = 0; i < span_count;) {
+        int top = spans[2 * i];
+        int bottom = spans[2 * i + 1];
+        // Merge the spans that overlap or touch this one
+        for (i++; i < span_count && spans[2 * i] <= bottom; i++) {
+            if (spans[2 * i + 1] > bottom)
+                bottom = spans[2 * i + 1];
+        }
+        xcb_shm_get_image_cookie_t cookie =
+            xcb_shm_get_image(connection, drawable, 0, top, width, bottom - top, ~0,
+                              XCB_IMAGE_FORMAT_Z_PIXMAP, segment,
+                              slot->data_offset + (size_t) top * ring->stride);
+        cvector_push_back(cookies, cookie);
+        bytes_exported += (size_t) (bottom - top) * ring->stride;
+    }
+
+    // The pixels are only there once the server has replied
+    bool complete = true;
+    for (size_t i = 0; i < cvector_size(cookies); ++i) {
+        xcb_generic_error_t *error = NULL;
+        xcb_shm_get_image_reply_t *reply = xcb_shm_get_image_reply(connection, cookies[i], &error);
+        if (!reply)
+            complete = false;
+        free(reply);
+        free(error);
+    }
+    // Nothing is published and history stays as it was. Which rows of the
+    // other slots the server got to isn't known either, so every slot is
+    // fetched whole next time.
+    if (!complete) {
+        for (int i = 0; i < FRAME_EXPORT_SLOTS; i++)
+            slot_frames[i] = 0;
+        return;
+    }
+
+    cvector(XRectangle) oldest = history[FRAME_EXPORT_SLOTS - 1];
+    memmove(&history[1], &history[0], sizeof(history[0]) * (FRAME_EXPORT_SLOTS - 1));
+    history[0] = damage;
+    damage = oldest;
+
+    if (cvector_size(history[0]) <= FRAME_EXPORT_MAX_RECTS) {
+        slot->rect_count = cvector_size(history[0]);
+        for (size_t i = 0; i < cvector_size(history[0]); ++i) {
+            slot->rects[i].x = history[0][i].x;
+            slot->rects[i].y = history[0][i].y;
+            slot->rects[i].width = history[0][i].width;
+            slot->rects[i].height = history[0][i].height;
+        }
+    } else {
+        slot->rect_count = 1;
+        slot->rects[0] = (Frame_Rect) { 0, 0, width, height };
+    }
+
+    slot_frames[index] = sequence;
+    atomic_store_explicit(&slot->sequence, sequence, memory_order_release);
+    atomic_store_explicit(&ring->latest, sequence, memory_order_release);
+    frames_exported++;
+
+    // A consumer that's gone is only noticed here
+    for (size_t i = 0; i < cvector_size(consumers);) {
+        if (send(consumers[i], &sequence, sizeof(sequence), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+            errno != EAGAIN) {
+            close(consumers[i]);
+            cvector_erase(consumers, i);
+            continue;
+        }
+        i++;
+    }
+    if (cvector_empty(consumers))
+        free_ring();
+}
+
+
+void frame_export_dump_stats(void) {
+    if (listen_fd < 0)
+        return;
+    fprintf(stderr, "frame export: %zu consumers, %lu frames, %lu bytes\n",
+            cvector_size(consumers), frames_exported, bytes_exported);
+}
@@ -0,0 +1,75 @@
+#ifndef FRAME_EXPORT_H_
+#define FRAME_EXPORT_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+/*
+ * Composited frames are published to local consumers (screen recorders,
+ * remote desktop) through a ring of full frames in a memfd. A consumer
+ * connects to the export socket and gets the memfd with SCM_RIGHTS, then
+ * an 8 byte sequence number on the socket for every new frame.
+ *
+ * Every slot always holds a complete frame: when a slot is reused it gets
+ * everything that changed since it was last written, straight from the X
+ * server through MIT-SHM. The rectangles in a slot are only what changed
+ * since the previous frame, so a consumer that saw that one copies just
+ * those, and one that fell behind copies the whole slot.
+ *
+ * A slot's sequence is 0 while it's written. A consumer reads `latest`,
+ * copies from the slot and checks the slot's sequence didn't change.
+ */
+#define FRAME_EXPORT_MAGIC 0x454d5246 /* "FRME" */
+#define FRAME_EXPORT_VERSION 1
+#define FRAME_EXPORT_SLOTS 3
+#define FRAME_EXPORT_MAX_RECTS 64
+
+typedef struct Frame_Rect {
+    int16_t x, y;
+    uint16_t width, height;
+} Frame_Rect;
+
+typedef struct Frame_Slot {
+    _Atomic uint64_t sequence;
+    uint64_t data_offset;       // of the pixels, from the start of the memfd
+    uint32_t rect_count;        // a single rectangle covering everything if too many
+    Frame_Rect rects[FRAME_EXPORT_MAX_RECTS];
+} Frame_Slot;
+
+typedef struct Frame_Ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t stride;            // bytes per row, 32 bits per pixel
+    uint32_t depth;
+    uint32_t red_mask, green_mask, blue_mask;
+    uint32_t slot_count;
+    _Atomic uint64_t latest;    // sequence of the newest complete frame, 0 if none
+    Frame_Slot slots[FRAME_EXPORT_SLOTS];
+} Frame_Ring;
+
+// Starts listening on `path`. Returns false if the socket can't be set up.
+bool frame_export_init(Display *display, const char *path);
+
+// The listening socket, -1 when exporting is off
+int frame_export_listen_fd(void);
+
+// Takes a waiting consumer. Returns true if that created the ring, in which
+// case the whole screen should be painted so there is a first frame.
+bool frame_export_accept(int width, int height);
+
+// Frames are only worth producing while someone is reading them
+bool frame_export_active(void);
+
+// Copies what changed in `drawable`, which holds the whole screen, into the
+// next slot and tells the consumers
+void frame_export_publish(Drawable drawable, const XRectangle *rects, int count);
+
+// Disconnects everyone and drops the ring, for when the screen size changes
+void frame_export_reset(void);
+
+void frame_export_dump_stats(void);
+
+#endif /* FRAME_EXPORT_H_ */
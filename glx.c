@@ -0,0 +1,514 @@
+#define GL_GLEXT_PROTOTYPES
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <GL/glx.h>
+#include <GL/glxext.h>
+
+#include "cvector.h"
+#include "glx.h"
+
+// Textures one draw call can sample from. Windows past that go in another
+// batch, which is rare as only the windows under the damage are drawn.
+#define GL_MAX_BATCH_TEXTURES 16
+// Frames of damage kept to bring an older back buffer up to date
+#define GL_DAMAGE_HISTORY 4
+
+// The config texture_from_pixmap needs for pixmaps of one depth
+typedef struct Pixmap_Config {
+    bool found;
+    GLXFBConfig config;
+    int format;             // GLX_TEXTURE_FORMAT_RGB(A)_EXT
+    bool y_inverted;
+} Pixmap_Config;
+
+typedef struct Vertex {
+    GLfloat x, y;           // on the screen
+    GLfloat u, v;           // texel
+    GLfloat alpha;
+    GLfloat unit;           // which of the batch's textures
+} Vertex;
+
+static Display *display;
+static GLXContext context;
+static GLXWindow glx_window;
+static int screen_width, screen_height;
+static bool buffer_age;
+
+static Pixmap_Config rgb_config;    // depth 24
+static Pixmap_Config rgba_config;   // depth 32
+
+static PFNGLXBINDTEXIMAGEEXTPROC bind_tex_image;
+static PFNGLXRELEASETEXIMAGEEXTPROC release_tex_image;
+
+static GLuint program;
+static GLint screen_size_location;
+static GLuint vertex_buffer;
+static int batch_textures;
+
+// The damage of the last frames, newest first
+static XRectangle damage_history[GL_DAMAGE_HISTORY];
+static int history_length;
+
+static unsigned long frames_drawn;
+static unsigned long draw_calls;
+static unsigned long texture_binds;
+static unsigned long full_repaints;
+
+
+static const char *vertex_source =
+    "#version 130\n"
+    "uniform vec2 screen_size;\n"
+    "in vec2 position;\n"
+    "in vec2 texel_in;\n"
+    "in float alpha_in;\n"
+    "in float unit_in;\n"
+    "out vec2 texel;\n"
+    "out float alpha;\n"
+    "flat out float unit;\n"
+    "void main() {\n"
+    "    gl_Position = vec4(position.x / screen_size.x * 2.0 - 1.0,\n"
+    "                       1.0 - position.y / screen_size.y * 2.0, 0.0, 1.0);\n"
+    "    texel = texel_in;\n"
+    "    alpha = alpha_in;\n"
+    "    unit = unit_in;\n"
+    "}\n";
+
+
+static bool intersect(XRectangle *a, const XRectangle *b) {
+    int x0 = a->x > b->x ? a->x : b->x;
+    int y0 = a->y > b->y ? a->y : b->y;
+    int x1 = a->x + a->width < b->x + b->width ? a->x + a->width : b->x + b->width;
+    int y1 = a->y + a->height < b->y + b->height ? a->y + a->height : b->y + b->height;
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+    a->x = x0;
+    a->y = y0;
+    a->width = x1 - x0;
+    a->height = y1 - y0;
+    return true;
+}
+
+
+static void unite(XRectangle *a, const XRectangle *b) {
+    if (!b->width || !b->height)
+        return;
+    if (!a->width || !a->height) {
+        *a = *b;
+        return;
+    }
+    int x0 = a->x < b->x ? a->x : b->x;
+    int y0 = a->y < b->y ? a->y : b->y;
+    int x1 = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+    int y1 = a->y + a->height > b->y + b->height ? a->y + a->height : b->y + b->height;
+    a->x = x0;
+    a->y = y0;
+    a->width = x1 - x0;
+    a->height = y1 - y0;
+}
+
+
+static bool has_extension(const char *extensions, const char *name) {
+    size_t length = strlen(name);
+    for (const char *p = extensions; p && (p = strstr(p, name)); p += length) {
+        if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+
+// Looks for a config that can bind pixmaps of `depth` as 2D textures
+static void find_pixmap_config(int screen, int depth, Pixmap_Config *result) {
+    int count;
+    GLXFBConfig *configs = glXGetFBConfigs(display, screen, &count);
+    result->found = false;
+    for (int i = 0; i < count && !result->found; i++) {
+        int value;
+        glXGetFBConfigAttrib(display, configs[i], GLX_DRAWABLE_TYPE, &value);
+        if (!(value & GLX_PIXMAP_BIT))
+            continue;
+        glXGetFBConfigAttrib(display, configs[i], GLX_BIND_TO_TEXTURE_TARGETS_EXT, &value);
+        if (!(value & GLX_TEXTURE_2D_BIT_EXT))
+            continue;
+        int format = depth == 32 ? GLX_TEXTURE_FORMAT_RGBA_EXT : GLX_TEXTURE_FORMAT_RGB_EXT;
+        glXGetFBConfigAttrib(display, configs[i],
+                             depth == 32 ? GLX_BIND_TO_TEXTURE_RGBA_EXT : GLX_BIND_TO_TEXTURE_RGB_EXT, &value);
+        if (!value)
+            continue;
+        XVisualInfo *visual = glXGetVisualFromFBConfig(display, configs[i]);
+        if (!visual)
+            continue;
+        bool matches = visual->depth == depth;
+        XFree(visual);
+        if (!matches)
+            continue;
+
+        result->found = true;
+        result->config = configs[i];
+        result->format = format;
+        value = 0;
+        glXGetFBConfigAttrib(display, configs[i], GLX_Y_INVERTED_EXT, &value);
+        result->y_inverted = value;
+    }
+    if (configs)
+        XFree(configs);
+}
+
+
+static GLuint compile_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint ok;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "Shader doesn't compile: %s\n", log);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+
+// A sampler array can't be indexed by a varying in GLSL 1.30, so the
+// fragment shader picks the texture with a chain of branches. texelFetch
+// needs no derivatives, which makes that safe.
+static bool build_program() {
+    char fragment_source[4096];
+    int length = snprintf(fragment_source, sizeof(fragment_source),
+                          "#version 130\n"
+                          "uniform sampler2D textures[%d];\n"
+                          "in vec2 texel;\n"
+                          "in float alpha;\n"
+                          "flat in float unit;\n"
+                          "out vec4 color;\n"
+                          "void main() {\n"
+                          "    ivec2 p = ivec2(texel);\n"
+                          "    int u = int(unit + 0.5);\n"
+                          "    vec4 c;\n"
+                          "    if (u == 0) c = texelFetch(textures[0], p, 0);\n",
+                          batch_textures);
+    for (int i = 1; i < batch_textures; i++) {
+        length += snprintf(fragment_source + length, sizeof(fragment_source) - length,
+                           "    else if (u == %d) c = texelFetch(textures[%d], p, 0);\n", i, i);
+    }
+    snprintf(fragment_source + length, sizeof(fragment_source) - length,
+             "    color = c * alpha;\n"
+             "}\n");
+
+    GLuint vertex = compile_shader(GL_VERTEX_SHADER, vertex_source);
+    GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+    if (!vertex || !fragment)
+        return false;
+
+    program = glCreateProgram();
+    glAttachShader(program, vertex);
+    glAttachShader(program, fragment);
+    glBindAttribLocation(program, 0, "position");
+    glBindAttribLocation(program, 1, "texel_in");
+    glBindAttribLocation(program, 2, "alpha_in");
+    glBindAttribLocation(program, 3, "unit_in");
+    glBindFragDataLocation(program, 0, "color");
+    glLinkProgram(program);
+    glDeleteShader(vertex);
+    glDeleteShader(fragment);
+    GLint ok;
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        fprintf(stderr, "Shaders don't link\n");
+        return false;
+    }
+
+    glUseProgram(program);
+    screen_size_location = glGetUniformLocation(program, "screen_size");
+    for (int i = 0; i < batch_textures; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "textures[%d]", i);
+        glUniform1i(glGetUniformLocation(program, name), i);
+    }
+    return true;
+}
+
+
+bool glx_init(Display *dpy, Window window, int width, int height, bool vsync) {
+    display = dpy;
+    int screen = DefaultScreen(display);
+
+    int error_base, event_base;
+    if (!glXQueryExtension(display, &error_base, &event_base)) {
+        fprintf(stderr, "No GLX extension\n");
+        return false;
+    }
+    const char *extensions = glXQueryExtensionsString(display, screen);
+    if (!has_extension(extensions, "GLX_EXT_texture_from_pixmap")) {
+        fprintf(stderr, "No GLX_EXT_texture_from_pixmap\n");
+        return false;
+    }
+    bind_tex_image = (PFNGLXBINDTEXIMAGEEXTPROC) glXGetProcAddress((const GLubyte *) "glXBindTexImageEXT");
+    release_tex_image = (PFNGLXRELEASETEXIMAGEEXTPROC) glXGetProcAddress((const GLubyte *) "glXReleaseTexImageEXT");
+    buffer_age = has_extension(extensions, "GLX_EXT_buffer_age");
+
+    // A double buffered config with the overlay's visual
+    XWindowAttributes attr;
+    XGetWindowAttributes(display, window, &attr);
+    VisualID visual_id = XVisualIDFromVisual(attr.visual);
+    int count;
+    int attributes[] = {
+        GLX_DRAWABLE_TYPE, GLX_WINDOW_BIT,
+        GLX_RENDER_TYPE, GLX_RGBA_BIT,
+        GLX_DOUBLEBUFFER, True,
+        None
+    };
+    GLXFBConfig *configs = glXChooseFBConfig(display, screen, attributes, &count);
+    GLXFBConfig window_config = NULL;
+    for (int i = 0; i < count && !window_config; i++) {
+        int id;
+        glXGetFBConfigAttrib(display, configs[i], GLX_VISUAL_ID, &id);
+        if ((VisualID) id == visual_id)
+            window_config = configs[i];
+    }
+    if (configs)
+        XFree(configs);
+    if (!window_config) {
+        fprintf(stderr, "No GLX config for the overlay window\n");
+        return false;
+    }
+
+    find_pixmap_config(screen, 24, &rgb_config);
+    find_pixmap_config(screen, 32, &rgba_config);
+    if (!rgb_config.found) {
+        fprintf(stderr, "No GLX config to bind depth 24 pixmaps with\n");
+        return false;
+    }
+
+    context = glXCreateNewContext(display, window_config, GLX_RGBA_TYPE, NULL, True);
+    if (!context) {
+        fprintf(stderr, "Can't create a GLX context\n");
+        return false;
+    }
+    glx_window = glXCreateWindow(display, window_config, window, NULL);
+    if (!glXMakeContextCurrent(display, glx_window, glx_window, context)) {
+        fprintf(stderr, "Can't make the GLX context current\n");
+        glXDestroyContext(display, context);
+        return false;
+    }
+
+    if (has_extension(extensions, "GLX_EXT_swap_control")) {
+        PFNGLXSWAPINTERVALEXTPROC swap_interval =
+            (PFNGLXSWAPINTERVALEXTPROC) glXGetProcAddress((const GLubyte *) "glXSwapIntervalEXT");
+        swap_interval(display, glx_window, vsync ? 1 : 0);
+    } else if (has_extension(extensions, "GLX_MESA_swap_control")) {
+        PFNGLXSWAPINTERVALMESAPROC swap_interval =
+            (PFNGLXSWAPINTERVALMESAPROC) glXGetProcAddress((const GLubyte *) "glXSwapIntervalMESA");
+        swap_interval(vsync ? 1 : 0);
+    }
+
+    GLint units;
+    glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &units);
+    batch_textures = units < GL_MAX_BATCH_TEXTURES ? units : GL_MAX_BATCH_TEXTURES;
+    if (!build_program()) {
+        glXMakeContextCurrent(display, None, None, NULL);
+        glXDestroyContext(display, context);
+        return false;
+    }
+
+    glGenBuffers(1, &vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, x));
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, u));
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, alpha));
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *) offsetof(Vertex, unit));
+
+    // Textures hold premultiplied alpha
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glEnable(GL_SCISSOR_TEST);
+    glDisable(GL_DEPTH_TEST);
+
+    glx_resize(width, height);
+    fprintf(stderr, "OpenGL backend on %s\n", (const char *) glGetString(GL_RENDERER));
+    return true;
+}
+
+
+void glx_resize(int width, int height) {
+    screen_width = width;
+    screen_height = height;
+    glViewport(0, 0, width, height);
+    glUniform2f(screen_size_location, width, height);
+    history_length = 0;
+}
+
+
+bool glx_texture_bind(Gl_Texture *texture, Pixmap pixmap, int depth, int width, int height) {
+    Pixmap_Config *config = depth == 32 ? &rgba_config : depth == 24 ? &rgb_config : NULL;
+    if (!config || !config->found)
+        return false;
+
+    int attributes[] = {
+        GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
+        GLX_TEXTURE_FORMAT_EXT, config->format,
+        None
+    };
+    texture->glx_pixmap = glXCreatePixmap(display, config->config, pixmap, attributes);
+    if (!texture->glx_pixmap)
+        return false;
+    texture->width = width;
+    texture->height = height;
+    texture->y_inverted = config->y_inverted;
+
+    glGenTextures(1, &texture->texture);
+    glBindTexture(GL_TEXTURE_2D, texture->texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    bind_tex_image(display, texture->glx_pixmap, GLX_FRONT_LEFT_EXT, NULL);
+    texture_binds++;
+    return true;
+}
+
+
+void glx_texture_refresh(Gl_Texture *texture) {
+    glBindTexture(GL_TEXTURE_2D, texture->texture);
+    release_tex_image(display, texture->glx_pixmap, GLX_FRONT_LEFT_EXT);
+    bind_tex_image(display, texture->glx_pixmap, GLX_FRONT_LEFT_EXT, NULL);
+    texture_binds++;
+}
+
+
+void glx_texture_release(Gl_Texture *texture) {
+    glBindTexture(GL_TEXTURE_2D, texture->texture);
+    release_tex_image(display, texture->glx_pixmap, GLX_FRONT_LEFT_EXT);
+    glDeleteTextures(1, &texture->texture);
+    glXDestroyPixmap(display, texture->glx_pixmap);
+    texture->texture = 0;
+    texture->glx_pixmap = 0;
+}
+
+
+XRectangle glx_begin_frame(const XRectangle *damage) {
+    XRectangle screen = { 0, 0, screen_width, screen_height };
+    XRectangle area = *damage;
+
+    // Without buffer age nothing is known about the back buffer
+    unsigned int age = 0;
+    if (buffer_age)
+        glXQueryDrawable(display, glx_window, GLX_BACK_BUFFER_AGE_EXT, &age);
+    if (age == 0 || age - 1 > (unsigned int) history_length) {
+        area = screen;
+        full_repaints++;
+    } else {
+        for (unsigned int i = 0; i + 1 < age; i++)
+            unite(&area, &damage_history[i]);
+    }
+
+    memmove(&damage_history[1], &damage_history[0], sizeof(damage_history[0]) * (GL_DAMAGE_HISTORY - 1));
+    damage_history[0] = *damage;
+    if (history_length < GL_DAMAGE_HISTORY)
+        history_length++;
+
+    if (!intersect(&area, &screen))
+        area.width = area.height = 0;
+    return area;
+}
+
+
+// Two triangles showing `r` of the screen from `texture` at `x`, `y`
+static void push_quad(cvector(Vertex) *vertices, const Gl_Texture *texture, int x, int y,
+                      const XRectangle *r, float alpha, int unit) {
+    float x0 = r->x, y0 = r->y, x1 = r->x + r->width, y1 = r->y + r->height;
+    float u0 = x0 - x, u1 = x1 - x;
+    float v0 = y0 - y, v1 = y1 - y;
+    if (!texture->y_inverted) {
+        v0 = texture->height - v0;
+        v1 = texture->height - v1;
+    }
+    Vertex corners[6] = {
+        { x0, y0, u0, v0, alpha, unit }, { x1, y0, u1, v0, alpha, unit }, { x1, y1, u1, v1, alpha, unit },
+        { x0, y0, u0, v0, alpha, unit }, { x1, y1, u1, v1, alpha, unit }, { x0, y1, u0, v1, alpha, unit },
+    };
+    for (int i = 0; i < 6; i++)
+        cvector_push_back(*vertices, corners[i]);
+}
+
+
+void glx_paint(const Gl_Texture *background, const Gl_Quad *quads, int count, const XRectangle *area) {
+    static cvector(Vertex) vertices = NULL;
+    static cvector(int) batch_ends = NULL;          // in vertices
+    static cvector(const Gl_Texture *) batches = NULL;  // batch_textures per batch
+    cvector_clear(vertices);
+    cvector_clear(batch_ends);
+    cvector_clear(batches);
+
+    if (area->width && area->height) {
+        int unit = 0;
+        // Bottom up, starting with the wallpaper
+        for (int i = -1; i < count; i++) {
+            const Gl_Quad *quad = i < 0 ? NULL : &quads[count - 1 - i];
+            const Gl_Texture *texture = quad ? quad->texture : background;
+            int x = quad ? quad->x : 0, y = quad ? quad->y : 0;
+            XRectangle whole = { x, y, texture->width, texture->height };
+            if (!intersect(&whole, area))
+                continue;
+
+            // Each batch samples its own set of textures
+            size_t first = cvector_size(batch_ends) * batch_textures;
+            for (unit = 0; first + unit < cvector_size(batches) && batches[first + unit] != texture; unit++)
+                ;
+            if (first + unit == cvector_size(batches)) {
+                if (unit == batch_textures) {
+                    cvector_push_back(batch_ends, cvector_size(vertices));
+                    unit = 0;
+                }
+                cvector_push_back(batches, texture);
+            }
+
+            float alpha = quad ? quad->alpha : 1.0f;
+            if (!quad || !quad->clip) {
+                push_quad(&vertices, texture, x, y, &whole, alpha, unit);
+                continue;
+            }
+            for (int c = 0; c < quad->clip_count; c++) {
+                XRectangle part = quad->clip[c];
+                if (intersect(&part, &whole))
+                    push_quad(&vertices, texture, x, y, &part, alpha, unit);
+            }
+        }
+        cvector_push_back(batch_ends, cvector_size(vertices));
+
+        glScissor(area->x, screen_height - area->y - area->height, area->width, area->height);
+        glBufferData(GL_ARRAY_BUFFER, cvector_size(vertices) * sizeof(Vertex), vertices, GL_STREAM_DRAW);
+        int start = 0;
+        for (size_t b = 0; b < cvector_size(batch_ends); b++) {
+            for (int t = 0; t < batch_textures && b * batch_textures + t < cvector_size(batches); t++) {
+                glActiveTexture(GL_TEXTURE0 + t);
+                glBindTexture(GL_TEXTURE_2D, batches[b * batch_textures + t]->texture);
+            }
+            glDrawArrays(GL_TRIANGLES, start, batch_ends[b] - start);
+            start = batch_ends[b];
+            draw_calls++;
+        }
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+    glXSwapBuffers(display, glx_window);
+    frames_drawn++;
+}
+
+
+void glx_dump_stats(void) {
+    fprintf(stderr, "opengl: %lu frames, %.2f draw calls a frame, %lu full repaints, %lu texture binds\n",
+            frames_drawn, frames_drawn ? (double) draw_calls / frames_drawn : 0.0,
+            full_repaints, texture_binds);
+}
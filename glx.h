@@ -0,0 +1,60 @@
+#ifndef GLX_H_
+#define GLX_H_
+
+#include <stdbool.h>
+#include <X11/Xlib.h>
+#include <GL/gl.h>
+#include <GL/glx.h>
+
+/*
+ * The OpenGL backend. Window pixmaps are bound as textures with
+ * GLX_EXT_texture_from_pixmap instead of being wrapped in XRender pictures,
+ * and a frame is drawn into the composite overlay window as one batch of
+ * quads, scissored to what has to be repainted. Needs nothing beyond GLSL
+ * 1.30, so it runs on llvmpipe under Xvfb as well as on a GPU.
+ */
+
+typedef struct Gl_Texture {
+    GLXPixmap glx_pixmap;
+    GLuint texture;
+    int width, height;
+    bool y_inverted;        // row 0 of the texture is the top of the pixmap
+} Gl_Texture;
+
+// One window as the GL backend draws it
+typedef struct Gl_Quad {
+    const Gl_Texture *texture;
+    int x, y;                   // of the texture on the screen
+    float alpha;                // window opacity
+    const XRectangle *clip;     // on the screen, NULL to draw all of the texture
+    int clip_count;
+} Gl_Quad;
+
+// Sets up a context drawing into `window`, which covers the screen. With
+// `vsync` buffer swaps wait for vblank.
+bool glx_init(Display *display, Window window, int width, int height, bool vsync);
+
+void glx_resize(int width, int height);
+
+// Binds `pixmap`, of the given depth, as a texture. Only depth 24 and 32
+// pixmaps have matching configs.
+bool glx_texture_bind(Gl_Texture *texture, Pixmap pixmap, int depth, int width, int height);
+
+// Binds the pixmap again, the contents of a bound pixmap are only
+// guaranteed to show changes made before it was bound
+void glx_texture_refresh(Gl_Texture *texture);
+
+void glx_texture_release(Gl_Texture *texture);
+
+// Starts a frame for `damage`, and returns the part of the screen that has
+// to be drawn: more than the damage when the back buffer is older than the
+// last frame.
+XRectangle glx_begin_frame(const XRectangle *damage);
+
+// Draws `background` and the quads, topmost first, into `area` of the back
+// buffer and swaps
+void glx_paint(const Gl_Texture *background, const Gl_Quad *quads, int count, const XRectangle *area);
+
+void glx_dump_stats(void);
+
+#endif /* GLX_H_ */
@@ -1,12 +1,22 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 #include <sys/poll.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
@@ -14,10 +24,22 @@
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xpresent.h>
+#include <X11/extensions/sync.h>
+#include <X11/extensions/scrnsaver.h>
+#include <X11/extensions/dpms.h>
+#include <X11/Xlib-xcb.h>
 
 #include "cvector.h"
 #include "cvector_utils.h"
 #include "stdbool.h"
+#include "config.h"
+#include "event_queue.h"
+#include "frame_export.h"
+#include "thumbnails.h"
+#include "swrender.h"
+#include "glx.h"
 
 enum Window_Opaqueness {
   SOLID = 0,
@@ -25,24 +47,129 @@ enum Window_Opaqueness {
   ARGB = 2,
 };
 
+// The rarely touched half of a client. Nothing in here is read by the paint
+// passes except when a picture has to be (re)created, so it lives behind a
+// pointer and stays out of the way of the stacking walk.
+typedef struct Client_Cold {
+    bool materialized;      // the fields up to pixmap are only valid once this is set
+    unsigned long requests; // requests made for the window so far, for the stats
+    Visual *visual;
+    int depth;
+    int class;              // InputOutput or InputOnly
+    int map_state;
+    Bool override_redirect;
+    Damage damage;
+    int damage_level;               // the XDamageReportLevel damage was created with
+    int level_votes;                // evaluations in a row that wanted another level
+    unsigned int level_updates;     // damage updates since level_since
+    unsigned long level_area;       // and the pixels they covered
+    uint64_t level_since;
+    Pixmap pixmap;
+    bool shaped;
+    bool shape_stale;           // shape_rects needs to be fetched again
+    XRectangle *shape_rects;    // bounding shape relative to the window, if shaped
+    int shape_rect_count;
+    XRectangle shape_bounds;
+    Window client_window;       // the window carrying WM_CLASS, below the WM's frame
+    // The property cache, filled in when the client is mapped and kept up
+    // to date from PropertyNotify, see store_property
+    char *class_name;
+    char *instance_name;
+    unsigned int property_opacity;  // _NET_WM_WINDOW_OPACITY, OPAQUE if unset
+    XSyncCounter counter_property;  // the extended one of _NET_WM_SYNC_REQUEST_COUNTER
+    bool fullscreen;                // _NET_WM_STATE has _NET_WM_STATE_FULLSCREEN
+    unsigned int walks_pending;     // windows of the frame still being looked at
+    unsigned char property_changes; // bits of the Cached_Property that changed since they were acted on
+    int rule;                       // index into config.rules, -1 if none matches
+    unsigned int opacity;           // what we actually paint with
+    // The range of spatial grid cells the client is listed in, x1/y1 exclusive
+    short grid_x0, grid_y0, grid_x1, grid_y1;
+    unsigned int damage_events;     // since the active client was last picked
+    // The part of the client not covered by solid windows above it or cut off
+    // by the edge of the screen, kept up to date by update_visibility
+    cvector(XRectangle) visible;
+    bool fully_visible;             // visible is just the client's own rectangle
+    XserverRegion visible_region;   // visible on the server side, created on demand
+    // The blurred background of a client with blur, the size of the client,
+    // and the bounds of the part of it that has to be blurred again
+    Picture blur_cache;
+    XRectangle blur_dirty;
+    // Damaged since its thumbnail was made, and when the next one may be
+    bool thumbnail_dirty;
+    uint64_t thumbnail_due;
+    // A copy of the contents for the software backend, and the part of it
+    // that's out of date, relative to the window
+    Sw_Surface *surface;
+    XRectangle surface_dirty;
+    // The pixmap bound as a texture for the OpenGL backend, and whether it
+    // has to be bound again to show the latest damage
+    Gl_Texture *texture;
+    bool texture_stale;
+    bool slept_damage;          // damaged while painting was suspended
+    unsigned long debug_damage;     // pixels, since the last paint debugging summary
+    // What the client's caches take, as of the last enforce_memory_budget,
+    // and when it was last seen not occluded
+    unsigned long memory;
+    uint64_t last_visible;
+    // The extended _NET_WM_SYNC_REQUEST_COUNTER of a client that paces its
+    // frames by ours, see update_frame_counter
+    XSyncCounter frame_counter;
+    XSyncAlarm frame_alarm;
+    bool frame_drawing;             // the counter is odd, a frame is half drawn
+    XserverRegion held_damage;      // the damage of that frame so far
+    int64_t frame_done;             // finished frame not yet reported drawn, -1 if none
+    int64_t frame_drawn;            // reported drawn, but not its timings yet, -1 if none
+    uint64_t frame_drawn_time;      // CLOCK_MONOTONIC microseconds
+} Client_Cold;
+
+// Everything paint_all reads for every window on every frame: geometry, flags
+// and the XIDs of the pictures and regions it composites with. Clients are
+// stored by value in `clients`, so a walk over the stack is a linear scan
+// over a packed array instead of a pointer chase through XWindowAttributes.
 typedef struct Client {
     Window window;
-    Pixmap pixmap;
-    XWindowAttributes attr;
-    enum Window_Opaqueness opaqueness;
-    int damaged;
-    Damage damage;
     Picture picture;
     Picture alpha_pict;
     XserverRegion border_size;
     XserverRegion extents;
-    bool shaped;
-    XRectangle shape_bounds;
-
     XserverRegion border_clip;
+    short x, y;
+    unsigned short width, height;
+    unsigned short border_width;
+    unsigned char opaqueness;   // enum Window_Opaqueness
+    unsigned char damaged;
+    unsigned char occluded;     // nothing of it is on screen, see update_visibility
+    unsigned char blur;         // the background shows through blurred
+    unsigned char corner_radius;    // what the corners are rounded by, see update_corner_radius
+    int slot;                   // stable id used by the spatial grid
+    Client_Cold *cold;
 } Client;
 
-cvector(Client *) clients = NULL;
+// Clients in stacking order, topmost first. Because the clients are stored
+// by value, any insert or erase (adding, destroying or restacking a window)
+// moves them around: a Client * must not be held across one of those.
+cvector(Client) clients = NULL;
+
+// A uniform grid over the root window. Each cell lists the slots of the
+// viewable clients whose extents touch it, so paint_all can find the few
+// clients under a damaged rectangle without walking the whole stack.
+#define GRID_CELL_SIZE 128
+
+int grid_columns, grid_rows;
+cvector(int) *grid_cells = NULL;
+
+// Clients move around inside `clients`, so the grid refers to them by slot
+// instead. slot_index maps a slot back to the client's current index and is
+// rebuilt lazily whenever the stack has changed.
+cvector(int) slot_index = NULL;
+cvector(unsigned int) slot_stamps = NULL;
+cvector(int) free_slots = NULL;
+bool slot_index_dirty;
+unsigned int query_stamp;
+
+// Indices of the clients paint_all has to look at for the current frame,
+// in stacking order
+cvector(int) paint_candidates = NULL;
 
 
 Display *display;
@@ -56,50 +183,437 @@ int root_height, root_width;
 // Why _exactly_ it was chosen to be done this way, I'm not sure. But it's fine.
 Picture root_picture; // the actual reference to the root picture
 Picture root_buffer; // the temporary buffer
+Pixmap root_buffer_pixmap; // kept for the frame export, which reads the pixels back
 Picture root_tile; // holds the desktop wallpaper image
 
+// The software backend composites into sw_frame and puts it into root_buffer.
+// sw_background is the wallpaper spread over the screen, fetched again when
+// root_tile isn't the one it was made from.
+Sw_Surface sw_frame;
+Sw_Surface sw_background;
+bool sw_surfaces;
+Picture sw_background_tile;
+
+// The OpenGL backend draws into the overlay in one frame for all outputs,
+// paced by the fastest one. The wallpaper is bound like a window.
+uint64_t gl_next_frame;
+Gl_Texture gl_background;
+Pixmap gl_background_pixmap;
+Picture gl_background_tile;
+
 XserverRegion all_damage; // when this is not zero, it means the screen was damaged and we need to redraw
-bool clip_changed; // Seems to be set to true when the bounds of a window has changed
+// Set when the bounds, stacking or opaqueness of a window has changed, which
+// means the visible parts of the clients have to be worked out again
+bool clip_changed;
+// Set when an event doesn't agree with our idea of the stacking order, the
+// order is then resynced from the server before the next frame
+bool stacking_suspect;
 
 int xfixes_event, xfixes_error;
 int damage_event, damage_error;
 int composite_event, composite_error;
 int render_event, render_error;
 int xshape_event, xshape_error;
+int xrandr_event, xrandr_error;
+bool has_xrandr;
 int composite_opcode;
 
 Atom opacity_atom;
+Atom wm_state_atom;
+Atom fullscreen_atom;
+
+xcb_connection_t *connection;
+
+// The properties kept in the cache, and where each one is read from
+enum Cached_Property {
+    PROPERTY_CLASS,             // WM_CLASS of the client window
+    PROPERTY_OPACITY,           // _NET_WM_WINDOW_OPACITY of the frame
+    PROPERTY_FRAME_COUNTER,     // _NET_WM_SYNC_REQUEST_COUNTER of the client window
+    PROPERTY_STATE,             // _NET_WM_STATE of the client window
+    PROPERTY_ROOT_PIXMAP,       // _XROOTPMAP_ID of the root
+    PROPERTY_SETROOT_PIXMAP,    // _XSETROOT_ID of the root
+    PROPERTY_COUNT,
+};
+
+Atom property_atoms[PROPERTY_COUNT];
+const Atom property_types[PROPERTY_COUNT] = {
+    XA_STRING, XA_CARDINAL, XA_CARDINAL, XA_ATOM, XA_PIXMAP, XA_PIXMAP,
+};
+// In 32 bit units
+const uint32_t property_lengths[PROPERTY_COUNT] = { 256, 1, 2, 32, 1, 1 };
+
+typedef struct Property_Fetch {
+    Window frame;       // the client it's for, None for the root
+    Window window;      // the window it's read from
+    enum Cached_Property property;
+    xcb_get_property_cookie_t cookie;
+} Property_Fetch;
+
+cvector(Property_Fetch) property_fetches = NULL;
+
+// One window of a frame being searched for the application's window, see
+// walk_frame. Both requests are sent together, and every window of a level
+// of the tree at once.
+typedef struct Frame_Walk {
+    Window frame;       // the client it's for
+    Window window;      // the window looked at
+    xcb_get_property_cookie_t state;    // its WM_STATE
+    xcb_query_tree_cookie_t tree;       // its children, in case it has none
+} Frame_Walk;
+
+cvector(Frame_Walk) frame_walks = NULL;
+bool property_changes;      // some client has property_changes to act on
+bool wallpaper_changed;
+Pixmap root_pixmaps[2];     // _XROOTPMAP_ID and _XSETROOT_ID, the first one set is the wallpaper
+
+#define OPAQUE 0xffffffff
+
+// Clients start out with XDamageReportNonEmpty: one notify, and the exact
+// damage is then collected on the server side with XDamageSubtract. Once a
+// second the rate and size of a client's damage is looked at, and busy
+// clients are switched to a level that fits them better:
+// - mostly big updates (video) get BoundingBox, the notify carries the
+//   bounds and there is no region to build on the server
+// - many small updates (terminals) get RawRectangles, every rectangle
+//   arrives in its own notify and nothing is painted beyond them
+#define DAMAGE_LEVEL_INTERVAL 1000000000ull
+#define BUSY_DAMAGE_RATE 20         // updates per second
+#define LARGE_DAMAGE 0.5            // average fraction of the window per update
+#define SMALL_DAMAGE 0.1
+#define DAMAGE_NOTIFY_SIZE 32       // every event is 32 bytes on the wire
+
+Config config;
+char *config_path;
+int inotify_fd = -1;
+
+// Events are read off the connection by the ingest thread and handed to the
+// render thread (the main thread, which owns all of the state above) through
+// this queue. wake_fd is an eventfd the ingest thread pokes after a batch.
+#define EVENT_QUEUE_SIZE 4096
+#define INGEST_BATCH 256
+
+Event_Queue event_queue;
+int wake_fd = -1;
+int signal_fd = -1;
+
+// Counters dumped to stderr on SIGUSR1. The atomic ones belong to the ingest
+// thread, the rest are only touched by the render thread.
+typedef struct Stats {
+    atomic_ulong events_ingested;
+    atomic_ulong events_coalesced;
+    unsigned long damage_pixels_dropped;    // damage on parts of windows that can't be seen
+    unsigned long layer_frames;             // frames painted on top of the retained layer
+    unsigned long layer_rebuilds;           // frames that had to composite part of it again
+    atomic_ulong damage_bytes;              // DamageNotify events received, in bytes, before coalescing
+    unsigned long damage_level_changes;
+    unsigned long windows_destroyed;        // and the requests they cost from create to destroy
+    unsigned long window_requests;
+    unsigned long unmapped_destroyed;       // the part of them that was never mapped
+    unsigned long unmapped_requests;
+    unsigned long frames_presented;
+    unsigned long missed_vblanks;           // frames shown later than the vblank they were meant for
+    unsigned long frames_timed;             // by the quality governor
+    unsigned long frames_over_budget;
+    unsigned long quality_downgrades;
+    unsigned long quality_upgrades;
+    unsigned long frames_drawn_sent;        // _NET_WM_FRAME_DRAWN messages
+    unsigned long frames_held;              // client frames whose damage waited for the end of the frame
+    unsigned long property_fetches;
+    unsigned long property_round_trips;     // the fetches were waited for in this many batches
+    unsigned long wakeups;                  // of the render thread from poll
+    unsigned long suspensions;
+    uint64_t suspended_ns;                  // before the current suspension
+    unsigned long evictions;                // of hidden clients' caches over the memory budget
+    unsigned long evicted_bytes;
+} Stats;
+
+Stats stats;
+
+// The quality governor's steps, each one giving up more than the last to
+// get frames back under the refresh interval
+enum Quality_Level {
+    QUALITY_FULL = 0,
+    QUALITY_NO_BLUR = 1,
+    QUALITY_NO_CORNERS = 2,
+    QUALITY_HALF_RATE = 3,
+};
+const char *quality_names[] = { "full", "no blur", "no rounded corners", "half frame rate" };
+
+// Frames are judged in windows of this many. A window with more than a
+// quarter of its frames over budget steps the quality down, and only three
+// windows in a row that all fit in half the budget step it back up, so a
+// level that was just given up isn't tried again straight away.
+#define QUALITY_WINDOW 30
+#define QUALITY_RECOVERY_WINDOWS 3
+
+enum Quality_Level quality_level = QUALITY_FULL;
+uint64_t quality_level_since;
+uint64_t quality_level_ns[4];       // time spent at each level before the current stint
+int quality_frames;                 // in the current window
+int quality_overruns;
+uint64_t quality_worst;             // longest frame of the window, in budgets of 1/1000
+int quality_good_windows;
+
+// Painting stops while the screen is blanked by the screen saver or DPMS.
+// Damage piles up in all_damage meanwhile and is painted in one frame when
+// the screen comes back.
+bool has_screensaver;
+int screensaver_event, screensaver_error;
+bool has_dpms;
+bool suspended;
+uint64_t suspended_since;
+// Where the wakeups per second of the stats are counted from
+uint64_t wakeups_since;
+unsigned long wakeups_before;
+
+// Set while a fullscreen window is drawn by the server directly
+bool unredirected;
+bool root_tile_filled; // root_tile is the plain background colour, not a wallpaper
+
+// One of these per active CRTC. all_damage is still collected for the whole
+// screen, but it is painted one output at a time: an output is only repainted
+// once its own refresh interval has passed, so a 60Hz laptop panel and a
+// 144Hz external monitor are paced independently.
+//
+// With Present, an output's frames are shown from a small pool of back
+// pixmaps at the next vblank, and the next frame is painted once the server
+// reports the last one complete. A back pixmap only gets the damage of the
+// frames it missed copied in from root_buffer, history holds that damage.
+#define PRESENT_BUFFERS 3
+
+typedef struct Back_Buffer {
+    Pixmap pixmap;
+    Picture picture;
+    bool idle;              // the server is done with it
+    unsigned long frame;    // the output's frame it holds, 0 if none yet
+} Back_Buffer;
+
+typedef struct Output {
+    RRCrtc crtc;
+    XRectangle bounds;
+    uint64_t refresh_interval; // nanoseconds
+    uint64_t next_frame;       // CLOCK_MONOTONIC nanoseconds
+    bool frame_pending;        // presented, waiting for the complete notify
+    uint32_t pending_serial;
+    uint64_t pending_since;
+    uint64_t last_msc, target_msc;
+    unsigned long frame_count;
+    Back_Buffer buffers[PRESENT_BUFFERS];
+    XserverRegion history[PRESENT_BUFFERS]; // damage of the last frames, newest first
+} Output;
+
+cvector(Output) outputs = NULL;
+
+#define DEFAULT_REFRESH_INTERVAL (1000000000ull / 60)
+
+// Frames go to the composite overlay window through Present when the
+// vsync option is on and the server has it, otherwise they are copied
+// straight to the root window and may tear
+#define PRESENT_TIMEOUT 100000000ull // stop waiting for a complete notify after this
+
+bool use_present;
+int present_opcode;
+Window overlay_window;
+uint32_t present_serial;
+
+// Clients that set an extended sync counter tell us when they start and
+// finish drawing a frame, and wait for _NET_WM_FRAME_DRAWN before they draw
+// the next one. That keeps a game or video from drawing frames nobody sees.
+bool has_sync;
+int sync_event, sync_error;
+int frame_sync_clients;     // with a counter, so the reports can be skipped when there's none
+Atom sync_counter_atom;
+Atom frame_drawn_atom;
+Atom frame_timings_atom;
+Atom net_supported_atom;
+
+// The retained layer: everything below the client that causes most of the
+// damage (the active client), composited once and kept in layer_picture.
+// Frames caused by the active client only copy the layer back instead of
+// painting the wallpaper and the windows below again. layer_dirty is what
+// has changed below the active client since it was last composited.
+#define LAYER_INTERVAL 1000000000ull // how often the active client is picked
+
+int layer_slot = -1;
+Picture layer_picture;
+XserverRegion layer_dirty;
+uint64_t next_layer_choice;
+
+// Scratch pictures for the blur passes, level i is the screen halved i times
+Picture blur_levels[MAX_BLUR_PASSES + 1];
+int blurred_clients; // viewable clients with blur, counted by update_visibility
+
+// Rounded corners are drawn through a disc of the corner radius, rendered
+// once and kept for as long as that radius (and opacity) is in use. Each
+// corner of a window takes one quarter of it.
+#define CORNER_MASK_CACHE 16
+
+typedef struct Corner_Mask {
+    int radius;
+    unsigned int alpha;     // 0..255, the opacity of a translucent window
+    Picture picture;        // A8, 2 * radius square
+} Corner_Mask;
+
+cvector(Corner_Mask) corner_masks = NULL;
 
-const char *backgroundProps[] = {
-        "_XROOTPMAP_ID",
-        "_XSETROOT_ID",
-        NULL,
+//////////////////////////////////////////////////////////////////////////////////
+// Paint debugging
+
+
+// The debug_paint key sets this and SIGUSR2 moves it on. What paint_all
+// composites is counted either way, the mode decides whether anything is
+// drawn over the frame and a summary printed.
+enum Debug_Paint debug_paint = DEBUG_PAINT_OFF;
+const char *debug_paint_names[] = { "off", "damage", "overdraw" };
+
+// Counted over one paint_all
+typedef struct Paint_Counts {
+    unsigned long frame;
+    unsigned long first_request;        // XNextRequest when the frame started
+    unsigned int composites;            // into root_buffer
+    unsigned long composited_pixels;    // of the rectangles composited, before clipping
+    unsigned long debug_requests;       // made to keep the overdraw count, not by the frame
+} Paint_Counts;
+
+Paint_Counts paint_counts;
+
+// A8, the size of the screen. Everything composited into root_buffer adds
+// OVERDRAW_STEP to it under the same clip while the overdraw view is on.
+Picture overdraw_picture;
+#define OVERDRAW_STEP 0x3333    // five composites saturate it
+
+// Premultiplied, cycled through frame by frame
+const XRenderColor damage_tints[] = {
+    { 0x4000, 0, 0, 0x4000 },
+    { 0x4000, 0x4000, 0, 0x4000 },
+    { 0, 0x4000, 0, 0x4000 },
+    { 0, 0x4000, 0x4000, 0x4000 },
+    { 0, 0, 0x4000, 0x4000 },
+    { 0x4000, 0, 0x4000, 0x4000 },
 };
+#define DAMAGE_TINTS (sizeof(damage_tints) / sizeof(damage_tints[0]))
+
+
+// Every composite into root_buffer goes through here
+void composite_buffer(int op, Picture src, Picture mask, int src_x, int src_y, int mask_x, int mask_y,
+                      int x, int y, unsigned int width, unsigned int height) {
+    XRenderComposite(display, op, src, mask, root_buffer, src_x, src_y, mask_x, mask_y, x, y, width, height);
+    paint_counts.composites++;
+    paint_counts.composited_pixels += (unsigned long) width * height;
+    if (overdraw_picture) {
+        XRenderColor step = { 0, 0, 0, OVERDRAW_STEP };
+        XRenderFillRectangle(display, PictOpAdd, overdraw_picture, &step, x, y, width, height);
+        paint_counts.debug_requests++;
+    }
+}
+
+
+// Clips root_buffer, and the overdraw count along with it
+void clip_buffer(XserverRegion region) {
+    XFixesSetPictureClipRegion(display, root_buffer, 0, 0, region);
+    if (overdraw_picture) {
+        XFixesSetPictureClipRegion(display, overdraw_picture, 0, 0, region);
+        paint_counts.debug_requests++;
+    }
+}
+
+
+void free_overdraw() {
+    if (overdraw_picture)
+        XRenderFreePicture(display, overdraw_picture);
+    overdraw_picture = 0;
+}
+
+
+// Starts counting a frame that paints `region` of the output covering
+// `bounds`. With a debug view on, returns a copy of the region for
+// debug_paint_frame, as paint_all whittles the original down.
+XserverRegion begin_paint_counts(XserverRegion region, const XRectangle *bounds) {
+    paint_counts.composites = 0;
+    paint_counts.composited_pixels = 0;
+    paint_counts.debug_requests = 0;
+    if (debug_paint == DEBUG_PAINT_OFF) {
+        paint_counts.first_request = XNextRequest(display);
+        return 0;
+    }
+
+    if (debug_paint == DEBUG_PAINT_OVERDRAW && !overdraw_picture) {
+        Pixmap pixmap = XCreatePixmap(display, root_window, root_width, root_height, 8);
+        overdraw_picture = XRenderCreatePicture(display, pixmap,
+                                                XRenderFindStandardFormat(display, PictStandardA8), 0, NULL);
+        XFreePixmap(display, pixmap);
+    }
+    XserverRegion painted = XFixesCreateRegion(display, NULL, 0);
+    XFixesCopyRegion(display, painted, region);
+    if (overdraw_picture) {
+        XRenderColor zero = { 0, 0, 0, 0 };
+        XFixesSetPictureClipRegion(display, overdraw_picture, 0, 0, painted);
+        XRenderFillRectangle(display, PictOpSrc, overdraw_picture, &zero,
+                             bounds->x, bounds->y, bounds->width, bounds->height);
+    }
+    paint_counts.first_request = XNextRequest(display);
+    return painted;
+}
+
+
+// Draws the debug view over `painted` (which is destroyed) in root_buffer
+// and prints the summary of the frame. The view stays in root_buffer until
+// the pixels are painted again, so what's tinted is what changed lately.
+void debug_paint_frame(XserverRegion painted, const XRectangle *bounds, const XRectangle *rects, int rect_count) {
+    unsigned long requests = XNextRequest(display) - paint_counts.first_request -
+        paint_counts.debug_requests - paint_counts.composites;
+    paint_counts.frame++;
+
+    XFixesSetPictureClipRegion(display, root_buffer, 0, 0, painted);
+    if (debug_paint == DEBUG_PAINT_DAMAGE) {
+        XRenderColor tint = damage_tints[paint_counts.frame % DAMAGE_TINTS];
+        XRenderFillRectangle(display, PictOpOver, root_buffer, &tint,
+                             bounds->x, bounds->y, bounds->width, bounds->height);
+    } else if (overdraw_picture) {
+        XRenderColor red = { 0xffff, 0, 0, 0xffff };
+        Picture heat = XRenderCreateSolidFill(display, &red);
+        XRenderComposite(display, PictOpOver, heat, overdraw_picture, root_buffer,
+                         0, 0, bounds->x, bounds->y, bounds->x, bounds->y, bounds->width, bounds->height);
+        XRenderFreePicture(display, heat);
+    }
+    XFixesDestroyRegion(display, painted);
+
+    unsigned long damaged = 0;
+    for (int i = 0; i < rect_count; i++)
+        damaged += (unsigned long) rects[i].width * rects[i].height;
+
+    // Damage is counted as it comes in, so with several outputs the first
+    // one painted takes all of it
+    int busiest = -1;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].cold->debug_damage &&
+            (busiest < 0 || clients[i].cold->debug_damage > clients[busiest].cold->debug_damage))
+            busiest = i;
+    }
+
+    fprintf(stderr, "paint %lu: %dx%d+%d+%d, %d rects %lu px, %u composites %lu px, %lu other requests",
+            paint_counts.frame, bounds->width, bounds->height, bounds->x, bounds->y,
+            rect_count, damaged, paint_counts.composites, paint_counts.composited_pixels, requests);
+    if (busiest >= 0) {
+        Client_Cold *cold = clients[busiest].cold;
+        fprintf(stderr, ", most damage 0x%lx (%s) %lu px", clients[busiest].window,
+                cold->class_name ? cold->class_name : "?", cold->debug_damage);
+        for (size_t i = 0; i < cvector_size(clients); ++i)
+            clients[i].cold->debug_damage = 0;
+    }
+    fputc('\n', stderr);
+}
 
 /////////////////////////////////////////////////////////////////////////////////////
 // This takes the desktop wallpaper (if one is set) and turns it into a picture
 // so that we can draw it when it's time to composite the screen
 //
+// The wallpaper pixmap comes from the property cache, which follows the
+// root's properties
 Picture create_root_tile() {
-    Pixmap pixmap = 0;
-    int actual_format;
-    unsigned long items_count;
-    unsigned long bytes_after;
-    unsigned char *prop;
+    Pixmap pixmap = root_pixmaps[0] ? root_pixmaps[0] : root_pixmaps[1];
     bool fill = false;
 
-    Atom actual_type;
-    for (int p = 0; backgroundProps[p]; p++) {
-        if (XGetWindowProperty(display, root_window, XInternAtom(display, backgroundProps[p], false),
-                               0, 4, false, AnyPropertyType,
-                               &actual_type, &actual_format, &items_count, &bytes_after, &prop) == Success &&
-            actual_type == XInternAtom(display, "PIXMAP", false) && actual_format == 32 && items_count == 1) {
-            memcpy(&pixmap, prop, 4);
-            XFree(prop);
-            fill = false;
-            break;
-        }
-    }
     if (!pixmap) {
         pixmap = XCreatePixmap(display, root_window, 1, 1, XDefaultDepth(display, default_screen));
         fill = true;
@@ -110,9 +624,12 @@ Picture create_root_tile() {
     Picture picture = XRenderCreatePicture(display, pixmap,
                                            XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
                                            CPRepeat, &pa);
-    if (fill) { // If no background is set, then will just fill the background with the color 0x8080
+    root_tile_filled = fill;
+    if (fill) { // If no background is set, then will just fill the background with the configured color
         XRenderColor c;
-        c.red = c.green = c.blue = 0x8080;
+        c.red = config.background[0];
+        c.green = config.background[1];
+        c.blue = config.background[2];
         c.alpha = 0xffff;
         XRenderFillRectangle(display, PictOpSrc, picture, &c, 0, 0, 1, 1);
     }
@@ -127,386 +644,2868 @@ void paint_root() {
     if (!root_tile)
         root_tile = create_root_tile();
 
-    XRenderComposite(display, PictOpSrc,
-                     root_tile, 0, root_buffer,
+    composite_buffer(PictOpSrc, root_tile, 0,
                      0, 0, 0, 0, 0, 0, root_width, root_height);
 }
 
 
-XserverRegion client_extents(Client *client) {
-    XRectangle r;
-    r.x = client->attr.x;
-    r.y = client->attr.y;
-    r.width = client->attr.width + client->attr.border_width * 2;
-    r.height = client->attr.height + client->attr.border_width * 2;
-    return XFixesCreateRegion(display, &r, 1);
+// The wallpaper spread over a screen-sized pixmap, for the backends that
+// don't composite with root_tile themselves
+Pixmap wallpaper_pixmap() {
+    if (!root_tile)
+        root_tile = create_root_tile();
+
+    Pixmap pixmap = XCreatePixmap(display, root_window, root_width, root_height,
+                                  XDefaultDepth(display, default_screen));
+    Picture picture = XRenderCreatePicture(display, pixmap,
+                                           XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
+                                           0, NULL);
+    XRenderComposite(display, PictOpSrc, root_tile, None, picture,
+                     0, 0, 0, 0, 0, 0, root_width, root_height);
+    XRenderFreePicture(display, picture);
+    return pixmap;
 }
 
 
-XserverRegion get_border_size(Client *client) {
-    XserverRegion border;
-    /*
-     * if window doesn't exist anymore,  this will generate an error_handler
-     * as well as not generate a region.  Perhaps a better XFixes
-     * architecture would be to have a request that copies instead
-     * of creates, that way you'd just end up with an empty region
-     * instead of an invalid XID.
-     */
-    border = XFixesCreateRegionFromWindow(display, client->window, WindowRegionBounding);
-    /* translate this */
-    XFixesTranslateRegion(display, border,
-                          client->attr.x + client->attr.border_width,
-                          client->attr.y + client->attr.border_width);
-    return border;
+bool rectangles_intersect(const XRectangle *a, const XRectangle *b) {
+    return a->x < b->x + b->width && b->x < a->x + a->width &&
+           a->y < b->y + b->height && b->y < a->y + a->height;
 }
 
 
+unsigned long rectangle_area(const XRectangle *r) {
+    return (unsigned long) r->width * r->height;
+}
 
-void paint_all(XserverRegion region) {
-    if (!region) {
-        XRectangle r;
-        r.x = 0;
-        r.y = 0;
-        r.width = root_width;
-        r.height = root_height;
-        region = XFixesCreateRegion(display, &r, 1);
-    }
-    if (!root_buffer) {
-        Pixmap rootPixmap = XCreatePixmap(display, root_window, root_width, root_height,
-                                          XDefaultDepth(display, default_screen));
-        root_buffer = XRenderCreatePicture(display, rootPixmap,
-                                           XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
-                                           0, NULL);
-        XFreePixmap(display, rootPixmap);
-    }
-    XFixesSetPictureClipRegion(display, root_picture, 0, 0, region);
 
-    /* for (Client *w : clients) { */
-    for (size_t i = 0; i < cvector_size(clients); ++i) {
-        Client *w = clients[i];
-        /* never painted, ignore it */
-        if (!w->damaged) {
+// Intersects `a` with `b` in place, returns false if nothing is left
+bool clip_rectangle(XRectangle *a, const XRectangle *b) {
+    int left = a->x > b->x ? a->x : b->x;
+    int top = a->y > b->y ? a->y : b->y;
+    int right = a->x + a->width < b->x + b->width ? a->x + a->width : b->x + b->width;
+    int bottom = a->y + a->height < b->y + b->height ? a->y + a->height : b->y + b->height;
+    if (left >= right || top >= bottom)
+        return false;
+    a->x = left;
+    a->y = top;
+    a->width = right - left;
+    a->height = bottom - top;
+    return true;
+}
+
+
+// Cuts `hole` out of every rectangle in `pieces`, splitting those it overlaps
+// into up to four bands around it
+void subtract_rectangle(cvector(XRectangle) *pieces, const XRectangle *hole) {
+    size_t count = cvector_size(*pieces);
+    for (size_t i = 0; i < count;) {
+        XRectangle piece = (*pieces)[i];
+        if (!rectangles_intersect(&piece, hole)) {
+            i++;
             continue;
         }
-        /* if invisible, ignore it */
-        if (w->attr.x + w->attr.width < 1 || w->attr.y + w->attr.height < 1
-            || w->attr.x >= root_width || w->attr.y >= root_height)
-            continue;
-        if (!w->picture) {
-            XRenderPictureAttributes pa;
-            XRenderPictFormat *format;
-            Drawable draw = w->window;
-
-            if (!w->pixmap)
-                w->pixmap = XCompositeNameWindowPixmap(display, w->window);
-            if (w->pixmap)
-                draw = w->pixmap;
-
-            format = XRenderFindVisualFormat(display, w->attr.visual);
-            pa.subwindow_mode = IncludeInferiors;
-            w->picture = XRenderCreatePicture(display, draw,
-                                              format,
-                                              CPSubwindowMode,
-                                              &pa);
-        }
-        if (clip_changed) {
-            if (w->border_size) {
-                XFixesDestroyRegion(display, w->border_size);
-                w->border_size = 0;
-            }
-            if (w->extents) {
-                XFixesDestroyRegion(display, w->extents);
-                w->extents = 0;
-            }
-            if (w->border_clip) {
-                XFixesDestroyRegion(display, w->border_clip);
-                w->border_clip = 0;
-            }
+        (*pieces)[i] = (*pieces)[count - 1];
+        (*pieces)[count - 1] = (*pieces)[cvector_size(*pieces) - 1];
+        cvector_pop_back(*pieces);
+        count--;
+
+        int right = piece.x + piece.width;
+        int bottom = piece.y + piece.height;
+        int hole_right = hole->x + hole->width;
+        int hole_bottom = hole->y + hole->height;
+        int top = piece.y > hole->y ? piece.y : hole->y;
+        int middle_bottom = bottom < hole_bottom ? bottom : hole_bottom;
+        XRectangle r;
+        if (hole->y > piece.y) {
+            r = (XRectangle) { piece.x, piece.y, piece.width, hole->y - piece.y };
+            cvector_push_back(*pieces, r);
         }
-        if (w->border_size == 0)
-            w->border_size = get_border_size(w);
-        if (w->extents == 0)
-            w->extents = client_extents(w);
-        if (w->opaqueness == SOLID) {
-            int x, y, wid, hei;
-
-            x = w->attr.x;
-            y = w->attr.y;
-            wid = w->attr.width + w->attr.border_width * 2;
-            hei = w->attr.height + w->attr.border_width * 2;
-
-            XFixesSetPictureClipRegion(display, root_buffer, 0, 0, region);
-            XFixesSubtractRegion(display, region, region, w->border_size);
-            XRenderComposite(display, PictOpSrc, w->picture, 0, root_buffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
+        if (hole_bottom < bottom) {
+            r = (XRectangle) { piece.x, hole_bottom, piece.width, bottom - hole_bottom };
+            cvector_push_back(*pieces, r);
         }
-        if (!w->border_clip) {
-            w->border_clip = XFixesCreateRegion(display, NULL, 0);
-            XFixesCopyRegion(display, w->border_clip, region);
+        if (hole->x > piece.x) {
+            r = (XRectangle) { piece.x, top, hole->x - piece.x, middle_bottom - top };
+            cvector_push_back(*pieces, r);
+        }
+        if (hole_right < right) {
+            r = (XRectangle) { hole_right, top, right - hole_right, middle_bottom - top };
+            cvector_push_back(*pieces, r);
         }
     }
+}
 
-    XFixesSetPictureClipRegion(display, root_buffer, 0, 0, region);
-
-    // This is the start of actually compositing the screen
-    // this composites the root_tile which is the background image of your computer to the root_buffer.
-    // If you didn't do this step, you would end up drawing the windows on top of themselves over and over
-    // leading to a trailing effect
-    //
-    paint_root();
 
-    // This is just a fancy for loop used in order to iterate through the
-    // clients list in reverse order. The reason we do this is because the
-    // clients list has the window that is at the top of the window hierarchy,
-    // at the front of the list. Therefore we have to composite the windows in
-    // reverse if we want the front item in the list to be rendered on top of
-    // all other windows.
+// Grows `a` to the bounding box of `a` and `b`. An empty `a` is just replaced.
+void union_rectangle(XRectangle *a, const XRectangle *b) {
+    if (!a->width || !a->height) {
+        *a = *b;
+        return;
+    }
+    int right = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+    int bottom = a->y + a->height > b->y + b->height ? a->y + a->height : b->y + b->height;
+    if (b->x < a->x)
+        a->x = b->x;
+    if (b->y < a->y)
+        a->y = b->y;
+    a->width = right - a->x;
+    a->height = bottom - a->y;
+}
 
-    /* for (int i = clients.size(); i--;) { */
-    for (int i = cvector_size(clients) - 1; i >= 0; --i) {
-        Client *w = clients[i];
-        XFixesSetPictureClipRegion(display, root_buffer, 0, 0, w->border_clip);
 
-        if (w->opaqueness == TRANSPARENT) {
-            int x, y, wid, hei;
-            XFixesIntersectRegion(display, w->border_clip, w->border_clip, w->border_size);
-            XFixesSetPictureClipRegion(display, root_buffer, 0, 0, w->border_clip);
+XRectangle expand_rectangle(const XRectangle *r, int by) {
+    XRectangle e = { r->x - by, r->y - by, r->width + 2 * by, r->height + 2 * by };
+    return e;
+}
 
-            x = w->attr.x;
-            y = w->attr.y;
-            wid = w->attr.width + w->attr.border_width * 2;
-            hei = w->attr.height + w->attr.border_width * 2;
 
-            XRenderComposite(display, PictOpOver, w->picture, w->alpha_pict, root_buffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        } else if (w->opaqueness == ARGB) {
-            int x, y, wid, hei;
-            XFixesIntersectRegion(display, w->border_clip, w->border_clip, w->border_size);
-            XFixesSetPictureClipRegion(display, root_buffer, 0, 0, w->border_clip);
+XRectangle client_rect(const Client *client) {
+    XRectangle r;
+    r.x = client->x;
+    r.y = client->y;
+    r.width = client->width + client->border_width * 2;
+    r.height = client->height + client->border_width * 2;
+    return r;
+}
 
-            x = w->attr.x;
-            y = w->attr.y;
-            wid = w->attr.width + w->attr.border_width * 2;
-            hei = w->attr.height + w->attr.border_width * 2;
 
-            XRenderComposite(display, PictOpOver, w->picture, w->alpha_pict, root_buffer,
-                             0, 0, 0, 0,
-                             x, y, wid, hei);
-        }
-        XFixesDestroyRegion(display, w->border_clip);
-        w->border_clip = 0;
-    }
-    XFixesDestroyRegion(display, region);
-    if (root_buffer != root_picture) {
-        XFixesSetPictureClipRegion(display, root_buffer, 0, 0, 0);
-        XRenderComposite(display, PictOpSrc, root_buffer, 0, root_picture,
-                         0, 0, 0, 0, 0, 0, root_width, root_height);
-    }
+XserverRegion client_extents(Client *client) {
+    XRectangle r = client_rect(client);
+    return XFixesCreateRegion(display, &r, 1);
 }
-//////////////////////////////////////////////////////////////////////////////////
 
 
-void add_damage(XserverRegion damage) {
-    if (all_damage) {
-        XFixesUnionRegion(display, all_damage, all_damage, damage);
-        XFixesDestroyRegion(display, damage);
-    } else
-        all_damage = damage;
+// Fetches the bounding shape of a shaped client, relative to its origin
+// inside the border. This is a round trip, so it's only done when a
+// ShapeNotify said the shape changed and the border size is next needed.
+void fetch_shape(Client *client) {
+    Client_Cold *cold = client->cold;
+    int ordering;
+
+    if (cold->shape_rects)
+        XFree(cold->shape_rects);
+    cold->shape_rects = XShapeGetRectangles(display, client->window, ShapeBounding,
+                                            &cold->shape_rect_count, &ordering);
+    if (!cold->shape_rects)
+        cold->shape_rect_count = 0;
+    cold->shape_stale = false;
 }
 
 
-void finish_unmap_client(Client *client) {
-    client->damaged = 0;
-
-    if (client->extents != 0) {
-        add_damage(client->extents);    /* destroys region */
-        client->extents = 0;
-    }
+XserverRegion get_border_size(Client *client) {
+    Client_Cold *cold = client->cold;
 
-    if (client->pixmap) {
-        XFreePixmap(display, client->pixmap);
-        client->pixmap = 0;
-    }
+    if (!cold->shaped)
+        return client_extents(client);
 
-    if (client->picture) {
-        XRenderFreePicture(display, client->picture);
-        client->picture = 0;
-    }
+    // Built from our copy of the shape instead of XFixesCreateRegionFromWindow,
+    // so a clip change doesn't cost a trip through the window's shape
+    if (cold->shape_stale)
+        fetch_shape(client);
+    XserverRegion border = XFixesCreateRegion(display, cold->shape_rects, cold->shape_rect_count);
+    /* translate this */
+    XFixesTranslateRegion(display, border,
+                          client->x + client->border_width,
+                          client->y + client->border_width);
+    return border;
+}
 
-    /* don't care about properties anymore */
-    XSelectInput(display, client->window, 0);
 
+void invalidate_border_size(Client *client) {
     if (client->border_size) {
         XFixesDestroyRegion(display, client->border_size);
         client->border_size = 0;
     }
-    if (client->border_clip) {
-        XFixesDestroyRegion(display, client->border_clip);
-        client->border_clip = 0;
-    }
-
-    clip_changed = true;
 }
 
 
+
 //////////////////////////////////////////////////////////////////////////////////
+// Spatial grid
 
 
-Client *get_client_from_window(Window id) {
-    for (size_t i = 0; i < cvector_size(clients); ++i) {
-        if (clients[i]->window == id)
-            return clients[i];
+int allocate_slot() {
+    int slot;
+    if (!cvector_empty(free_slots)) {
+        slot = free_slots[cvector_size(free_slots) - 1];
+        cvector_pop_back(free_slots);
+    } else {
+        slot = cvector_size(slot_index);
+        cvector_push_back(slot_index, -1);
+        cvector_push_back(slot_stamps, 0);
     }
-    return NULL;
+    slot_stamps[slot] = 0;
+    return slot;
 }
 
 
-void unmap_win(Window window) {
-    Client *client = get_client_from_window(window);
-    if (!client) return;
-    client->attr.map_state = IsUnmapped;
-
-    finish_unmap_client(client);
+void grid_remove(Client *client) {
+    Client_Cold *cold = client->cold;
+    for (int y = cold->grid_y0; y < cold->grid_y1; y++) {
+        for (int x = cold->grid_x0; x < cold->grid_x1; x++) {
+            int cell = y * grid_columns + x;
+            for (size_t i = 0; i < cvector_size(grid_cells[cell]); i++) {
+                if (grid_cells[cell][i] == client->slot) {
+                    grid_cells[cell][i] = grid_cells[cell][cvector_size(grid_cells[cell]) - 1];
+                    cvector_pop_back(grid_cells[cell]);
+                    break;
+                }
+            }
+        }
+    }
+    cold->grid_x0 = cold->grid_y0 = cold->grid_x1 = cold->grid_y1 = 0;
 }
 
 
-void determine_opaqueness(Client *client) {
-    XRenderPictFormat *format;
-
-    if (client->alpha_pict) {
-        XRenderFreePicture(display, client->alpha_pict);
-        client->alpha_pict = 0;
+// Puts the client into the cells its extents cover, or takes it out of the grid
+// if it isn't viewable. Cheap when the covered cells didn't change.
+void grid_update(Client *client) {
+    Client_Cold *cold = client->cold;
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+
+    if (cold->map_state == IsViewable && cold->class != InputOnly) {
+        XRectangle r = client_rect(client);
+        int right = r.x + r.width;
+        int bottom = r.y + r.height;
+        if (right > 0 && bottom > 0 && r.x < root_width && r.y < root_height) {
+            x0 = r.x > 0 ? r.x / GRID_CELL_SIZE : 0;
+            y0 = r.y > 0 ? r.y / GRID_CELL_SIZE : 0;
+            x1 = (right - 1) / GRID_CELL_SIZE + 1;
+            y1 = (bottom - 1) / GRID_CELL_SIZE + 1;
+            if (x1 > grid_columns)
+                x1 = grid_columns;
+            if (y1 > grid_rows)
+                y1 = grid_rows;
+        }
     }
 
-    if (client->attr.class == InputOnly) {
-        format = NULL;
-    } else {
-        format = XRenderFindVisualFormat(display, client->attr.visual);
-    }
+    if (x0 == cold->grid_x0 && y0 == cold->grid_y0 && x1 == cold->grid_x1 && y1 == cold->grid_y1)
+        return;
 
-    enum Window_Opaqueness opaqueness;
-    if (format && format->type == PictTypeDirect && format->direct.alphaMask) {
-        opaqueness = ARGB;
-    } else {
-        opaqueness = SOLID;
-    }
-    client->opaqueness = opaqueness;
-    if (client->extents) {
-        XserverRegion damage;
-        damage = XFixesCreateRegion(display, NULL, 0);
-        XFixesCopyRegion(display, damage, client->extents);
-        add_damage(damage);
+    grid_remove(client);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++)
+            cvector_push_back(grid_cells[y * grid_columns + x], client->slot);
     }
+    cold->grid_x0 = x0;
+    cold->grid_y0 = y0;
+    cold->grid_x1 = x1;
+    cold->grid_y1 = y1;
 }
 
-void map_win(Window window) {
-    Client *client = get_client_from_window(window);
 
-    if (!client) return;
+// Sizes the grid to the root window and puts every client back into it
+void grid_rebuild() {
+    for (int i = 0; i < grid_columns * grid_rows; i++)
+        cvector_free(grid_cells[i]);
+    free(grid_cells);
 
-    client->attr.map_state = IsViewable;
+    grid_columns = (root_width + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE;
+    grid_rows = (root_height + GRID_CELL_SIZE - 1) / GRID_CELL_SIZE;
+    grid_cells = calloc(grid_columns * grid_rows, sizeof(*grid_cells));
 
-    determine_opaqueness(client);
-    client->damaged = 0;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client_Cold *cold = clients[i].cold;
+        cold->grid_x0 = cold->grid_y0 = cold->grid_x1 = cold->grid_y1 = 0;
+        grid_update(&clients[i]);
+    }
 }
 
-void add_client(Window window) {
-    // Allocate memory for a new Client
-    Client *client = (Client *)malloc(sizeof(Client));
-    if (!client) {
-        // Memory allocation failed
-        return;
+
+void refresh_slot_index() {
+    if (slot_index_dirty) {
+        for (size_t i = 0; i < cvector_size(clients); ++i)
+            slot_index[clients[i].slot] = i;
+        slot_index_dirty = false;
     }
+}
 
-    client->window = window;
 
-    // Get window attributes
-    if (!XGetWindowAttributes(display, window, &client->attr)) {
-        // If getting attributes fails, free allocated memory
-        free(client);
-        return;
+int compare_ints(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+
+// Fills paint_candidates with the indices of the clients whose extents
+// intersect any of `rects` within `bounds`, topmost first.
+void grid_query(const XRectangle *rects, int count, const XRectangle *bounds) {
+    cvector_clear(paint_candidates);
+    refresh_slot_index();
+    query_stamp++;
+
+    for (int r = 0; r < count; r++) {
+        XRectangle rect = rects[r];
+        int left = rect.x > bounds->x ? rect.x : bounds->x;
+        int top = rect.y > bounds->y ? rect.y : bounds->y;
+        int right = rect.x + rect.width < bounds->x + bounds->width ? rect.x + rect.width : bounds->x + bounds->width;
+        int bottom = rect.y + rect.height < bounds->y + bounds->height ? rect.y + rect.height : bounds->y + bounds->height;
+        if (left < 0)
+            left = 0;
+        if (top < 0)
+            top = 0;
+        if (left >= right || top >= bottom)
+            continue;
+        rect.x = left;
+        rect.y = top;
+        rect.width = right - left;
+        rect.height = bottom - top;
+
+        int x1 = (right - 1) / GRID_CELL_SIZE + 1;
+        int y1 = (bottom - 1) / GRID_CELL_SIZE + 1;
+        for (int y = top / GRID_CELL_SIZE; y < y1 && y < grid_rows; y++) {
+            for (int x = left / GRID_CELL_SIZE; x < x1 && x < grid_columns; x++) {
+                cvector(int) cell = grid_cells[y * grid_columns + x];
+                for (size_t i = 0; i < cvector_size(cell); i++) {
+                    int slot = cell[i];
+                    if (slot_stamps[slot] == query_stamp)
+                        continue;
+                    XRectangle extents = client_rect(&clients[slot_index[slot]]);
+                    if (!rectangles_intersect(&extents, &rect))
+                        continue;
+                    slot_stamps[slot] = query_stamp;
+                    cvector_push_back(paint_candidates, slot_index[slot]);
+                }
+            }
+        }
     }
 
-    client->shaped = false;
-    client->shape_bounds.x = client->attr.x;
-    client->shape_bounds.y = client->attr.y;
-    client->shape_bounds.width = client->attr.width;
-    client->shape_bounds.height = client->attr.height;
-    client->damaged = 0;
+    qsort(paint_candidates, cvector_size(paint_candidates), sizeof(int), compare_ints);
+}
 
-    client->pixmap = 0;
-    client->picture = 0;
 
-    if (client->attr.class == InputOnly) {
-        client->damage = 0;
-    } else {
-        client->damage = XDamageCreate(display, window, XDamageReportNonEmpty);
-        XShapeSelectInput(display, window, ShapeNotifyMask);
-    }
+//////////////////////////////////////////////////////////////////////////////////
+// Background blur
+//
+// Behind a translucent window with blur the background is scaled down by
+// half config.blur_passes times and back up again, with bilinear filtering
+// on every step (the dual filter, or dual Kawase, blur). The result is kept
+// in the client's blur_cache, so as long as nothing below the window changes
+// it's just copied back. Damage below the window marks the affected part of
+// the cache dirty, and only that part is blurred again.
 
-    client->alpha_pict = 0;
-    client->border_size = 0;
-    client->extents = 0;
-    client->border_clip = 0;
 
-    // Add the new client to the beginning of the vector
-    cvector_insert(clients, 0, client);
+// How far the blur of a pixel spreads
+int blur_radius() {
+    return 2 << config.blur_passes;
+}
 
-    if (client->attr.map_state == IsViewable) {
-        map_win(window);
+
+void free_blur_levels() {
+    for (int i = 0; i <= MAX_BLUR_PASSES; i++) {
+        if (blur_levels[i]) {
+            XRenderFreePicture(display, blur_levels[i]);
+            blur_levels[i] = 0;
+        }
     }
 }
 
 
+Picture blur_level(int level) {
+    if (!blur_levels[level]) {
+        int width = (root_width + (1 << level) - 1) >> level;
+        int height = (root_height + (1 << level) - 1) >> level;
+        Pixmap pixmap = XCreatePixmap(display, root_window, width, height,
+                                      XDefaultDepth(display, default_screen));
+        XRenderPictureAttributes pa;
+        pa.repeat = RepeatPad;
+        blur_levels[level] = XRenderCreatePicture(display, pixmap,
+                                                  XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
+                                                  CPRepeat, &pa);
+        XRenderSetPictureFilter(display, blur_levels[level], FilterBilinear, NULL, 0);
+        XFreePixmap(display, pixmap);
+    }
+    return blur_levels[level];
+}
 
 
-void restack_win(Window moving_window, Window target_window) {
-    //  The moving_window wants to be placed in front
-    // of the target_window and we shall do just that
-    Client *moving_client = NULL;
-    int moving_client_index = -1;
+void set_picture_scale(Picture picture, double scale) {
+    XTransform transform = {{
+        { XDoubleToFixed(scale), 0, 0 },
+        { 0, XDoubleToFixed(scale), 0 },
+        { 0, 0, XDoubleToFixed(1) },
+    }};
+    XRenderSetPictureTransform(display, picture, &transform);
+}
 
-    // Find the moving client
-    for (size_t i = 0; i < cvector_size(clients); ++i) {
-        if (clients[i]->window == moving_window) {
-            moving_client = clients[i];
-            moving_client_index = i;
-            break;
-        }
+
+void free_blur_cache(Client *client) {
+    if (client->cold->blur_cache) {
+        XRenderFreePicture(display, client->cold->blur_cache);
+        client->cold->blur_cache = 0;
     }
+}
 
-    // If the moving client was found, remove it from its current position
-    if (moving_client != NULL && moving_client_index != -1) {
-        cvector_erase(clients, moving_client_index);
 
-        // If a target window is specified, insert the moving client before it
-        if (target_window != 0) {
-            for (size_t i = 0; i < cvector_size(clients); ++i) {
-                if (clients[i]->window == target_window) {
-                    cvector_insert(clients, i, moving_client);
-                    return;
-                }
-            }
-        } else { // The moving client wants to go to the bottom of the list
-            cvector_push_back(clients, moving_client);
-        }
+// The whole background of every blurred client has to be blurred again,
+// because something changed that we can't pin on a single window
+void dirty_blur_all() {
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].blur)
+            clients[i].cold->blur_dirty = client_rect(&clients[i]);
     }
 }
 
 
-void configure_client(XConfigureEvent *ce) {
+// Damage at `area` on the client at `index` changes the background of the
+// blurred clients above it, within the radius of the blur
+void dirty_blur_above(const XRectangle *area, size_t index) {
+    if (!blurred_clients)
+        return;
+    XRectangle spread = expand_rectangle(area, blur_radius());
+    for (size_t i = 0; i < index; ++i) {
+        Client *w = &clients[i];
+        if (!w->blur || w->occluded)
+            continue;
+        XRectangle whole = client_rect(w);
+        XRectangle part = spread;
+        if (clip_rectangle(&part, &whole))
+            union_rectangle(&w->cold->blur_dirty, &part);
+    }
+}
+
+
+// Blurring the dirty part of a cache reads the background another radius
+// further out, and outside the damage root_buffer still holds the last frame
+// with the window itself on top. So that's repainted along with it.
+void add_blur_damage() {
+    if (!blurred_clients)
+        return;
+    XRectangle screen = { 0, 0, root_width, root_height };
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client *w = &clients[i];
+        if (!w->blur || w->occluded || !w->cold->blur_dirty.width)
+            continue;
+        XRectangle area = expand_rectangle(&w->cold->blur_dirty, blur_radius());
+        if (!clip_rectangle(&area, &screen))
+            continue;
+        XserverRegion region = XFixesCreateRegion(display, &area, 1);
+        if (layer_slot >= 0)
+            XFixesUnionRegion(display, layer_dirty, layer_dirty, region);
+        if (all_damage) {
+            XFixesUnionRegion(display, all_damage, all_damage, region);
+            XFixesDestroyRegion(display, region);
+        } else {
+            all_damage = region;
+        }
+    }
+}
+
+
+// Blurs what root_buffer holds under `rect`, which is in screen coordinates
+// and inside the client, into the client's cache
+void update_blur_cache(Client *client, const XRectangle *rect) {
+    Client_Cold *cold = client->cold;
+    XRectangle whole = client_rect(client);
+    XRectangle screen = { 0, 0, root_width, root_height };
+
+    if (!cold->blur_cache) {
+        Pixmap pixmap = XCreatePixmap(display, root_window, whole.width, whole.height,
+                                      XDefaultDepth(display, default_screen));
+        cold->blur_cache = XRenderCreatePicture(display, pixmap,
+                                                XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
+                                                0, NULL);
+        XFreePixmap(display, pixmap);
+    }
+
+    XRectangle sample = expand_rectangle(rect, blur_radius());
+    if (!clip_rectangle(&sample, &screen))
+        return;
+
+    int passes = config.blur_passes;
+    int widths[MAX_BLUR_PASSES + 1], heights[MAX_BLUR_PASSES + 1];
+    widths[0] = sample.width;
+    heights[0] = sample.height;
+
+    clip_buffer(None);
+    set_picture_scale(blur_level(0), 1);
+    XRenderComposite(display, PictOpSrc, root_buffer, 0, blur_level(0),
+                     sample.x, sample.y, 0, 0, 0, 0, sample.width, sample.height);
+
+    // Each step down averages 2x2 pixels, sampling right between them
+    for (int i = 1; i <= passes; i++) {
+        widths[i] = (widths[i - 1] + 1) / 2;
+        heights[i] = (heights[i - 1] + 1) / 2;
+        set_picture_scale(blur_level(i - 1), 2);
+        XRenderComposite(display, PictOpSrc, blur_level(i - 1), 0, blur_level(i),
+                         0, 0, 0, 0, 0, 0, widths[i], heights[i]);
+    }
+    for (int i = passes; i > 0; i--) {
+        set_picture_scale(blur_level(i), 0.5);
+        XRenderComposite(display, PictOpSrc, blur_level(i), 0, blur_level(i - 1),
+                         0, 0, 0, 0, 0, 0, widths[i - 1], heights[i - 1]);
+    }
+
+    set_picture_scale(blur_level(0), 1);
+    XRenderComposite(display, PictOpSrc, blur_level(0), 0, cold->blur_cache,
+                     rect->x - sample.x, rect->y - sample.y, 0, 0,
+                     rect->x - whole.x, rect->y - whole.y, rect->width, rect->height);
+}
+
+
+// Puts the blurred background of the client into root_buffer, clipped to
+// `clip`. The dirty part of the cache that's on the output being painted is
+// brought up to date first.
+void paint_blur(Client *client, XserverRegion clip, const XRectangle *bounds) {
+    Client_Cold *cold = client->cold;
+    XRectangle whole = client_rect(client);
+
+    if (!cold->blur_cache)
+        cold->blur_dirty = whole;
+    XRectangle dirty = cold->blur_dirty;
+    if (dirty.width && clip_rectangle(&dirty, bounds) && clip_rectangle(&dirty, &whole)) {
+        update_blur_cache(client, &dirty);
+        // Whatever is left on other outputs is done when they're painted
+        XRectangle left = cold->blur_dirty;
+        if (clip_rectangle(&left, bounds) && !memcmp(&left, &cold->blur_dirty, sizeof(left)))
+            cold->blur_dirty.width = cold->blur_dirty.height = 0;
+    }
+
+    clip_buffer(clip);
+    composite_buffer(PictOpSrc, cold->blur_cache, 0,
+                     0, 0, 0, 0, whole.x, whole.y, whole.width, whole.height);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Retained layer
+
+
+// Index of the active client in `clients`, or -1 if there's no layer
+int layer_index() {
+    if (layer_slot < 0)
+        return -1;
+    refresh_slot_index();
+    return slot_index[layer_slot];
+}
+
+
+// Everything below the active client has to be composited again
+void invalidate_layer() {
+    if (layer_slot < 0)
+        return;
+    XRectangle screen = { 0, 0, root_width, root_height };
+    if (layer_dirty)
+        XFixesDestroyRegion(display, layer_dirty);
+    layer_dirty = XFixesCreateRegion(display, &screen, 1);
+}
+
+
+void dirty_layer(XserverRegion damage) {
+    if (layer_slot >= 0)
+        XFixesUnionRegion(display, layer_dirty, layer_dirty, damage);
+}
+
+
+void drop_layer() {
+    layer_slot = -1;
+    if (layer_picture) {
+        XRenderFreePicture(display, layer_picture);
+        layer_picture = 0;
+    }
+    if (layer_dirty) {
+        XFixesDestroyRegion(display, layer_dirty);
+        layer_dirty = 0;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Rounded corners
+
+
+// The disc for `radius` at `alpha`, rendered on first use. Coverage is
+// sampled 4 x 4 per pixel so the edge is antialiased.
+Picture corner_mask(int radius, unsigned int alpha) {
+    for (size_t i = 0; i < cvector_size(corner_masks); ++i) {
+        if (corner_masks[i].radius == radius && corner_masks[i].alpha == alpha)
+            return corner_masks[i].picture;
+    }
+    // Opacities that come and go (fading) would otherwise pile up
+    if (cvector_size(corner_masks) == CORNER_MASK_CACHE) {
+        XRenderFreePicture(display, corner_masks[0].picture);
+        cvector_erase(corner_masks, 0);
+    }
+
+    int size = radius * 2;
+    int stride = (size + 3) & ~3;
+    char *data = calloc(stride, size);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int inside = 0;
+            for (int sy = 0; sy < 4; sy++) {
+                for (int sx = 0; sx < 4; sx++) {
+                    double dx = x + (sx + 0.5) / 4 - radius;
+                    double dy = y + (sy + 0.5) / 4 - radius;
+                    inside += dx * dx + dy * dy <= (double) radius * radius;
+                }
+            }
+            data[y * stride + x] = inside * alpha / 16;
+        }
+    }
+
+    Pixmap pixmap = XCreatePixmap(display, root_window, size, size, 8);
+    XImage *image = XCreateImage(display, XDefaultVisual(display, default_screen), 8, ZPixmap, 0,
+                                 data, size, size, 32, stride);
+    GC gc = XCreateGC(display, pixmap, 0, NULL);
+    XPutImage(display, pixmap, gc, image, 0, 0, 0, 0, size, size);
+    XFreeGC(display, gc);
+    XDestroyImage(image);   // frees data too
+
+    Corner_Mask mask;
+    mask.radius = radius;
+    mask.alpha = alpha;
+    mask.picture = XRenderCreatePicture(display, pixmap,
+                                        XRenderFindStandardFormat(display, PictStandardA8), 0, NULL);
+    XFreePixmap(display, pixmap);
+    cvector_push_back(corner_masks, mask);
+    return mask.picture;
+}
+
+
+// The client minus its corners, on the screen: a band across the middle and
+// the strips between the corners above and below it
+void corner_body(const Client *w, XRectangle body[3]) {
+    int r = w->corner_radius;
+    int wid = w->width + w->border_width * 2;
+    int hei = w->height + w->border_width * 2;
+    body[0] = (XRectangle) { w->x + r, w->y, wid - 2 * r, r };
+    body[1] = (XRectangle) { w->x, w->y + r, wid, hei - 2 * r };
+    body[2] = (XRectangle) { w->x + r, w->y + hei - r, wid - 2 * r, r };
+}
+
+
+// Composites the body of a rounded client with `op` through `mask`
+void paint_body(Client *w, int op, Picture mask) {
+    XRectangle body[3];
+    corner_body(w, body);
+    for (int i = 0; i < 3; i++) {
+        if (!body[i].width || !body[i].height)
+            continue;
+        composite_buffer(op, w->picture, mask,
+                         body[i].x - w->x, body[i].y - w->y, 0, 0,
+                         body[i].x, body[i].y, body[i].width, body[i].height);
+    }
+}
+
+
+// Blends the four corners of a rounded client over what's below them
+void paint_corners(Client *w, unsigned int alpha) {
+    int r = w->corner_radius;
+    int wid = w->width + w->border_width * 2;
+    int hei = w->height + w->border_width * 2;
+    Picture mask = corner_mask(r, alpha);
+    for (int i = 0; i < 4; i++) {
+        int right = i & 1, bottom = i >> 1;
+        int x = right ? wid - r : 0;
+        int y = bottom ? hei - r : 0;
+        composite_buffer(PictOpOver, w->picture, mask,
+                         x, y, right * r, bottom * r,
+                         w->x + x, w->y + y, r, r);
+    }
+}
+
+
+// The picture of the client's contents, created when first needed
+Picture client_picture(Client *w) {
+    if (!w->picture) {
+        XRenderPictureAttributes pa;
+        XRenderPictFormat *format;
+        Drawable draw = w->window;
+
+        if (!w->cold->pixmap)
+            w->cold->pixmap = XCompositeNameWindowPixmap(display, w->window);
+        if (w->cold->pixmap)
+            draw = w->cold->pixmap;
+
+        format = XRenderFindVisualFormat(display, w->cold->visual);
+        pa.subwindow_mode = IncludeInferiors;
+        w->picture = XRenderCreatePicture(display, draw,
+                                          format,
+                                          CPSubwindowMode,
+                                          &pa);
+    }
+    return w->picture;
+}
+
+
+// The first pass over the candidates from `first` up to `last`, topmost first.
+// Solid clients are painted and cut out of `region`, and every client is given
+// the region it's visible through for the second pass.
+void paint_solid(size_t first, size_t last, XserverRegion region) {
+    for (size_t c = first; c < last; ++c) {
+        Client *w = &clients[paint_candidates[c]];
+        /* never painted or hidden behind solid windows, ignore it */
+        if (!w->damaged || w->occluded) {
+            continue;
+        }
+        client_picture(w);
+        if (w->border_size == 0)
+            w->border_size = get_border_size(w);
+        if (w->extents == 0)
+            w->extents = client_extents(w);
+        if (w->opaqueness == SOLID && w->corner_radius) {
+            // Only the body is solid, the corners are blended with what's
+            // below them in the second pass
+            XRectangle body[3];
+            corner_body(w, body);
+            XserverRegion solid = XFixesCreateRegion(display, body, 3);
+            clip_buffer(region);
+            XFixesSubtractRegion(display, region, region, solid);
+            XFixesDestroyRegion(display, solid);
+            paint_body(w, PictOpSrc, None);
+        } else if (w->opaqueness == SOLID) {
+            int x, y, wid, hei;
+
+            x = w->x;
+            y = w->y;
+            wid = w->width + w->border_width * 2;
+            hei = w->height + w->border_width * 2;
+
+            clip_buffer(region);
+            XFixesSubtractRegion(display, region, region, w->border_size);
+            composite_buffer(PictOpSrc, w->picture, 0,
+                             0, 0, 0, 0,
+                             x, y, wid, hei);
+        }
+        if (!w->border_clip) {
+            w->border_clip = XFixesCreateRegion(display, NULL, 0);
+            XFixesCopyRegion(display, w->border_clip, region);
+        }
+    }
+}
+
+
+// The second pass, bottom up over the same candidates: translucent clients
+// are blended over whatever ended up below them
+void paint_translucent(size_t first, size_t last, const XRectangle *bounds) {
+    // This is just a fancy for loop used in order to iterate through the
+    // candidates (indices into the clients list) in reverse order. The reason
+    // we do this is because the clients list has the window that is at the top
+    // of the window hierarchy at the front of the list. Therefore we have to
+    // composite the windows in reverse if we want the front item in the list
+    // to be rendered on top of all other windows.
+
+    /* for (int i = clients.size(); i--;) { */
+    for (size_t c = last; c-- > first;) {
+        Client *w = &clients[paint_candidates[c]];
+        /* skipped by the first pass */
+        if (!w->border_clip)
+            continue;
+        clip_buffer(w->border_clip);
+
+        if (w->opaqueness == TRANSPARENT) {
+            int x, y, wid, hei;
+            XFixesIntersectRegion(display, w->border_clip, w->border_clip, w->border_size);
+            clip_buffer(w->border_clip);
+            if (w->blur)
+                paint_blur(w, w->border_clip, bounds);
+
+            x = w->x;
+            y = w->y;
+            wid = w->width + w->border_width * 2;
+            hei = w->height + w->border_width * 2;
+
+            if (w->corner_radius) {
+                paint_body(w, PictOpOver, w->alpha_pict);
+                paint_corners(w, w->cold->opacity >> 24);
+            } else {
+                composite_buffer(PictOpOver, w->picture, w->alpha_pict,
+                                 0, 0, 0, 0,
+                                 x, y, wid, hei);
+            }
+        } else if (w->opaqueness == ARGB) {
+            int x, y, wid, hei;
+            XFixesIntersectRegion(display, w->border_clip, w->border_clip, w->border_size);
+            clip_buffer(w->border_clip);
+            if (w->blur)
+                paint_blur(w, w->border_clip, bounds);
+
+            x = w->x;
+            y = w->y;
+            wid = w->width + w->border_width * 2;
+            hei = w->height + w->border_width * 2;
+
+            if (w->corner_radius) {
+                paint_body(w, PictOpOver, None);
+                paint_corners(w, 0xff);
+            } else {
+                composite_buffer(PictOpOver, w->picture, w->alpha_pict,
+                                 0, 0, 0, 0,
+                                 x, y, wid, hei);
+            }
+        } else if (w->corner_radius) {
+            // The corners the first pass left out of a solid client
+            XFixesIntersectRegion(display, w->border_clip, w->border_clip, w->border_size);
+            clip_buffer(w->border_clip);
+            paint_corners(w, 0xff);
+        }
+        XFixesDestroyRegion(display, w->border_clip);
+        w->border_clip = 0;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Software backend
+
+
+void free_client_surface(Client *client) {
+    Client_Cold *cold = client->cold;
+    if (!cold->surface)
+        return;
+    sw_surface_free(cold->surface);
+    free(cold->surface);
+    cold->surface = NULL;
+}
+
+
+void free_client_texture(Client *client) {
+    Client_Cold *cold = client->cold;
+    if (!cold->texture)
+        return;
+    glx_texture_release(cold->texture);
+    free(cold->texture);
+    cold->texture = NULL;
+}
+
+
+// Marks `area`, on the screen, as out of date in the client's copy
+void dirty_surface(Client *client, const XRectangle *area) {
+    XRectangle r = *area;
+    r.x -= client->x;
+    r.y -= client->y;
+    if (client->cold->surface_dirty.width)
+        union_rectangle(&client->cold->surface_dirty, &r);
+    else
+        client->cold->surface_dirty = r;
+}
+
+
+void free_software_frame() {
+    if (!sw_surfaces)
+        return;
+    sw_surface_free(&sw_frame);
+    sw_surface_free(&sw_background);
+    sw_surfaces = false;
+}
+
+
+void fetch_software_background() {
+    Pixmap pixmap = wallpaper_pixmap();
+    sw_fetch_rows(&sw_background, pixmap, 0, root_height);
+    sw_fetch_wait();
+    XFreePixmap(display, pixmap);
+    sw_background_tile = root_tile;
+}
+
+
+// Appends the client's bounding shape, on the screen, to `clips`. Returns
+// how many rectangles that is, or -1 if the client isn't shaped.
+int client_clip_rects(Client *w, cvector(XRectangle) *clips) {
+    Client_Cold *cold = w->cold;
+    if (!cold->shaped)
+        return -1;
+    if (cold->shape_stale)
+        fetch_shape(w);
+    for (int i = 0; i < cold->shape_rect_count; i++) {
+        XRectangle r = cold->shape_rects[i];
+        r.x += w->x + w->border_width;
+        r.y += w->y + w->border_width;
+        cvector_push_back(*clips, r);
+    }
+    return cold->shape_rect_count;
+}
+
+
+// paint_all for the software backend. The candidates' copies are brought up
+// to date, the damaged tiles composited on our side and put into root_buffer.
+void paint_software(const XRectangle *rects, int rect_count, const XRectangle *bounds) {
+    if (!sw_surfaces) {
+        if (!sw_surface_create(&sw_frame, root_width, root_height))
+            return;
+        if (!sw_surface_create(&sw_background, root_width, root_height)) {
+            sw_surface_free(&sw_frame);
+            return;
+        }
+        sw_surfaces = true;
+        sw_background_tile = 0;
+    }
+    if (!root_tile)
+        root_tile = create_root_tile();
+    if (sw_background_tile != root_tile)
+        fetch_software_background();
+
+    static cvector(Sw_Layer) layers = NULL;
+    static cvector(XRectangle) clips = NULL;
+    static cvector(int) clip_starts = NULL;
+    cvector_clear(layers);
+    cvector_clear(clips);
+    cvector_clear(clip_starts);
+
+    for (size_t c = 0; c < cvector_size(paint_candidates); ++c) {
+        Client *w = &clients[paint_candidates[c]];
+        Client_Cold *cold = w->cold;
+        if (!w->damaged || w->occluded)
+            continue;
+        if (!cold->pixmap)
+            cold->pixmap = XCompositeNameWindowPixmap(display, w->window);
+        if (!cold->pixmap)
+            continue;
+
+        int width = w->width + w->border_width * 2;
+        int height = w->height + w->border_width * 2;
+        if (!cold->surface) {
+            cold->surface = malloc(sizeof(Sw_Surface));
+            if (!cold->surface || !sw_surface_create(cold->surface, width, height)) {
+                free(cold->surface);
+                cold->surface = NULL;
+                continue;
+            }
+            cold->surface_dirty.x = cold->surface_dirty.y = 0;
+            cold->surface_dirty.width = width;
+            cold->surface_dirty.height = height;
+        }
+        if (cold->surface_dirty.width) {
+            sw_fetch_rows(cold->surface, cold->pixmap, cold->surface_dirty.y,
+                          cold->surface_dirty.y + cold->surface_dirty.height);
+            cold->surface_dirty.width = cold->surface_dirty.height = 0;
+        }
+
+        XRenderPictFormat *format = XRenderFindVisualFormat(display, cold->visual);
+        Sw_Layer layer;
+        layer.surface = cold->surface;
+        layer.x = w->x;
+        layer.y = w->y;
+        layer.alpha = cold->opacity >> 24;
+        layer.has_alpha = format && format->type == PictTypeDirect && format->direct.alphaMask;
+        layer.clip = NULL;
+        layer.clip_count = 0;
+        int clip_start = cvector_size(clips);
+        int clip_count = client_clip_rects(w, &clips);
+        // An empty shape shows nothing, which a NULL clip wouldn't say
+        if (clip_count == 0)
+            continue;
+        if (clip_count > 0)
+            layer.clip_count = clip_count;
+        cvector_push_back(clip_starts, clip_start);
+        cvector_push_back(layers, layer);
+    }
+    // The clip rectangles are only where they'll stay once they're all in
+    for (size_t i = 0; i < cvector_size(layers); ++i) {
+        if (layers[i].clip_count)
+            layers[i].clip = &clips[clip_starts[i]];
+    }
+
+    static cvector(XRectangle) damaged = NULL;
+    cvector_clear(damaged);
+    for (int i = 0; i < rect_count; i++) {
+        XRectangle r = rects[i];
+        if (clip_rectangle(&r, bounds))
+            cvector_push_back(damaged, r);
+    }
+
+    sw_fetch_wait();
+    sw_render(&sw_frame, &sw_background, layers, cvector_size(layers), damaged, cvector_size(damaged));
+    sw_push(&sw_frame, root_buffer_pixmap);
+}
+
+
+// Repaints `region` (which is destroyed) of the output covering `bounds`.
+// `rects` are the rectangles of the region as known on our side; only the
+// clients the spatial grid finds under them are looked at. The result is left
+// in root_buffer, show_output puts it on the screen.
+//
+// With a retained layer the candidates are split at the active client. The
+// ones above it (and the active client itself) are painted as usual, but
+// below it only the part of the layer that changed is composited, into
+// root_buffer and from there into the layer. The rest is copied from the
+// layer.
+void paint_all(XserverRegion region, const XRectangle *bounds, const XRectangle *rects, int rect_count) {
+    XRectangle screen;
+    screen.x = 0;
+    screen.y = 0;
+    screen.width = root_width;
+    screen.height = root_height;
+    if (!bounds)
+        bounds = &screen;
+
+    if (!region) {
+        region = XFixesCreateRegion(display, (XRectangle *) bounds, 1);
+        rects = bounds;
+        rect_count = 1;
+    }
+    if (!root_buffer) {
+        root_buffer_pixmap = XCreatePixmap(display, root_window, root_width, root_height,
+                                           XDefaultDepth(display, default_screen));
+        root_buffer = XRenderCreatePicture(display, root_buffer_pixmap,
+                                           XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
+                                           0, NULL);
+    }
+    grid_query(rects, rect_count, bounds);
+
+    if (config.backend == BACKEND_SOFTWARE) {
+        paint_software(rects, rect_count, bounds);
+        XFixesDestroyRegion(display, region);
+        return;
+    }
+
+    XserverRegion painted = begin_paint_counts(region, bounds);
+
+    // Candidates before `split` are the active client and the ones above it
+    int layer = layer_index();
+    size_t split = 0;
+    while (split < cvector_size(paint_candidates) && paint_candidates[split] <= layer)
+        split++;
+
+    paint_solid(0, split, region);
+
+    XserverRegion rebuild = 0;
+    if (layer >= 0) {
+        if (!layer_picture) {
+            Pixmap pixmap = XCreatePixmap(display, root_window, root_width, root_height,
+                                          XDefaultDepth(display, default_screen));
+            layer_picture = XRenderCreatePicture(display, pixmap,
+                                                 XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
+                                                 0, NULL);
+            XFreePixmap(display, pixmap);
+            invalidate_layer();
+        }
+
+        // What's left of the region shows the layer, either as it is or
+        // composited again where something below the active client changed
+        rebuild = XFixesCreateRegion(display, NULL, 0);
+        XFixesIntersectRegion(display, rebuild, region, layer_dirty);
+        XFixesSubtractRegion(display, region, region, layer_dirty);
+        clip_buffer(region);
+        composite_buffer(PictOpSrc, layer_picture, 0,
+                         bounds->x, bounds->y, 0, 0, bounds->x, bounds->y, bounds->width, bounds->height);
+        XFixesCopyRegion(display, region, rebuild);
+        stats.layer_frames++;
+    }
+
+    paint_solid(split, cvector_size(paint_candidates), region);
+
+    clip_buffer(region);
+
+    // This is the start of actually compositing the screen
+    // this composites the root_tile which is the background image of your computer to the root_buffer.
+    // If you didn't do this step, you would end up drawing the windows on top of themselves over and over
+    // leading to a trailing effect
+    //
+    paint_root();
+
+    paint_translucent(split, cvector_size(paint_candidates), bounds);
+
+    if (rebuild) {
+        XFixesSetPictureClipRegion(display, layer_picture, 0, 0, rebuild);
+        XRenderComposite(display, PictOpSrc, root_buffer, 0, layer_picture,
+                         bounds->x, bounds->y, 0, 0, bounds->x, bounds->y, bounds->width, bounds->height);
+        XFixesSetPictureClipRegion(display, layer_picture, 0, 0, 0);
+        XFixesSubtractRegion(display, layer_dirty, layer_dirty, rebuild);
+        XFixesDestroyRegion(display, rebuild);
+        stats.layer_rebuilds++;
+    }
+
+    paint_translucent(0, split, bounds);
+
+    if (painted)
+        debug_paint_frame(painted, bounds, rects, rect_count);
+    XFixesDestroyRegion(display, region);
+    clip_buffer(0);
+}
+//////////////////////////////////////////////////////////////////////////////////
+
+
+// Adds to all_damage without touching the blur caches, for damage whose
+// effect on them has already been taken care of
+void merge_damage(XserverRegion damage) {
+    if (all_damage) {
+        XFixesUnionRegion(display, all_damage, all_damage, damage);
+        XFixesDestroyRegion(display, damage);
+    } else
+        all_damage = damage;
+}
+
+
+void add_damage(XserverRegion damage) {
+    // We don't know what's below it, so it may be behind any blurred window
+    // and below the active client
+    if (blurred_clients)
+        dirty_blur_all();
+    dirty_layer(damage);
+    merge_damage(damage);
+}
+
+
+void damage_screen() {
+    XRectangle r;
+    r.x = 0;
+    r.y = 0;
+    r.width = root_width;
+    r.height = root_height;
+    add_damage(XFixesCreateRegion(display, &r, 1));
+}
+
+
+// Switches the debug view. What the old one drew is only gone once it's
+// painted over, so the whole screen is.
+void set_debug_paint(enum Debug_Paint mode) {
+    if (mode == debug_paint)
+        return;
+    if (mode != DEBUG_PAINT_OFF && config.backend != BACKEND_XRENDER) {
+        fprintf(stderr, "Paint debugging only works with the xrender backend\n");
+        return;
+    }
+    debug_paint = mode;
+    if (mode != DEBUG_PAINT_OVERDRAW)
+        free_overdraw();
+    for (size_t i = 0; i < cvector_size(clients); ++i)
+        clients[i].cold->debug_damage = 0;
+    damage_screen();
+    fprintf(stderr, "Paint debugging: %s\n", debug_paint_names[mode]);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Visibility
+
+
+// Works out which part of every client can actually be seen, walking the
+// stack from the top and cutting away what solid windows cover. Damage on
+// the hidden parts is then dropped as it arrives instead of repainting
+// pixels nobody will see. A client that comes out from behind something
+// gets its whole visible part repainted once.
+void update_visibility() {
+    static cvector(XRectangle) covered = NULL;
+    XRectangle screen = { 0, 0, root_width, root_height };
+
+    cvector_clear(covered);
+    blurred_clients = 0;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client *w = &clients[i];
+        Client_Cold *cold = w->cold;
+
+        if (cold->visible_region) {
+            XFixesDestroyRegion(display, cold->visible_region);
+            cold->visible_region = 0;
+        }
+        cvector_clear(cold->visible);
+
+        XRectangle rect = client_rect(w);
+        if (cold->map_state != IsViewable || cold->class == InputOnly ||
+            !clip_rectangle(&rect, &screen)) {
+            cold->fully_visible = false;
+            w->occluded = true;
+            continue;
+        }
+
+        cvector_push_back(cold->visible, rect);
+        for (size_t c = 0; c < cvector_size(covered) && !cvector_empty(cold->visible); c++)
+            subtract_rectangle(&cold->visible, &covered[c]);
+
+        XRectangle whole = client_rect(w);
+        cold->fully_visible = cvector_size(cold->visible) == 1 &&
+                              !memcmp(&cold->visible[0], &whole, sizeof(whole));
+
+        bool was_occluded = w->occluded;
+        w->occluded = cvector_empty(cold->visible);
+        if (was_occluded && !w->occluded && w->damaged)
+            add_damage(XFixesCreateRegion(display, cold->visible, cvector_size(cold->visible)));
+        if (w->blur && !w->occluded)
+            blurred_clients++;
+
+        // Shaped windows only cover their shape, don't bother with that.
+        // Rounded corners show what's below, only the body covers it.
+        if (w->opaqueness == SOLID && !cold->shaped && w->corner_radius) {
+            XRectangle body[3];
+            corner_body(w, body);
+            for (int b = 0; b < 3; b++) {
+                if (clip_rectangle(&body[b], &screen))
+                    cvector_push_back(covered, body[b]);
+            }
+        } else if (w->opaqueness == SOLID && !cold->shaped) {
+            cvector_push_back(covered, rect);
+        }
+    }
+    clip_changed = false;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+uint64_t mode_refresh_interval(XRRScreenResources *resources, RRMode mode) {
+    for (int i = 0; i < resources->nmode; i++) {
+        XRRModeInfo *m = &resources->modes[i];
+        if (m->id != mode)
+            continue;
+        if (!m->dotClock || !m->hTotal || !m->vTotal)
+            break;
+
+        uint64_t v_total = m->vTotal;
+        if (m->modeFlags & RR_DoubleScan)
+            v_total *= 2;
+        if (m->modeFlags & RR_Interlace)
+            v_total /= 2;
+        return 1000000000ull * m->hTotal * v_total / m->dotClock;
+    }
+    return DEFAULT_REFRESH_INTERVAL;
+}
+
+
+void free_output_buffers(Output *output) {
+    for (int i = 0; i < PRESENT_BUFFERS; i++) {
+        Back_Buffer *buffer = &output->buffers[i];
+        if (buffer->pixmap) {
+            XRenderFreePicture(display, buffer->picture);
+            XFreePixmap(display, buffer->pixmap);
+            buffer->pixmap = 0;
+        }
+        if (output->history[i]) {
+            XFixesDestroyRegion(display, output->history[i]);
+            output->history[i] = 0;
+        }
+    }
+}
+
+
+void add_output(RRCrtc crtc, int x, int y, int width, int height, uint64_t refresh_interval) {
+    Output output;
+    memset(&output, 0, sizeof(output));
+    output.crtc = crtc;
+    output.bounds.x = x;
+    output.bounds.y = y;
+    output.bounds.width = width;
+    output.bounds.height = height;
+    output.refresh_interval = refresh_interval;
+    cvector_push_back(outputs, output);
+}
+
+
+// Rebuilds the output list from the current RandR configuration. Without
+// RandR (or without any active CRTC) the whole screen is treated as one output.
+void update_outputs() {
+    for (size_t i = 0; i < cvector_size(outputs); ++i)
+        free_output_buffers(&outputs[i]);
+    cvector_clear(outputs);
+
+    if (has_xrandr) {
+        XRRScreenResources *resources = XRRGetScreenResourcesCurrent(display, root_window);
+        if (resources) {
+            for (int i = 0; i < resources->ncrtc; i++) {
+                XRRCrtcInfo *info = XRRGetCrtcInfo(display, resources, resources->crtcs[i]);
+                if (!info)
+                    continue;
+                if (info->mode != None && info->width && info->height)
+                    add_output(resources->crtcs[i], info->x, info->y, info->width, info->height,
+                               mode_refresh_interval(resources, info->mode));
+                XRRFreeCrtcInfo(info);
+            }
+            XRRFreeScreenResources(resources);
+        }
+    }
+
+    if (cvector_empty(outputs))
+        add_output(None, 0, 0, root_width, root_height, DEFAULT_REFRESH_INTERVAL);
+}
+
+
+// The output's refresh interval, unless the configured frame rate cap is lower
+uint64_t frame_budget(const Output *output) {
+    uint64_t interval = output->refresh_interval;
+    if (config.max_fps > 0 && 1000000000ull / config.max_fps > interval)
+        interval = 1000000000ull / config.max_fps;
+    return interval;
+}
+
+
+// The time between frames, which the quality governor may stretch
+uint64_t frame_interval(const Output *output) {
+    uint64_t interval = frame_budget(output);
+    if (quality_level >= QUALITY_HALF_RATE)
+        interval *= 2;
+    return interval;
+}
+
+
+// Once a second the client with the most damage events becomes the active
+// one, if it caused at least half of them. Otherwise the damage is spread
+// around and the layer would only be composited again and again.
+void choose_layer_client() {
+    // The other backends draw everything under the damage from scratch
+    if (config.backend != BACKEND_XRENDER)
+        return;
+    uint64_t now = now_ns();
+    if (now < next_layer_choice)
+        return;
+    next_layer_choice = now + LAYER_INTERVAL;
+
+    unsigned int total = 0;
+    int busiest = -1;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client_Cold *cold = clients[i].cold;
+        total += cold->damage_events;
+        if (!clients[i].occluded && cold->damage_events &&
+            (busiest < 0 || cold->damage_events > clients[busiest].cold->damage_events))
+            busiest = i;
+    }
+
+    int slot = -1;
+    if (busiest >= 0 && clients[busiest].cold->damage_events * 2 >= total)
+        slot = clients[busiest].slot;
+    for (size_t i = 0; i < cvector_size(clients); ++i)
+        clients[i].cold->damage_events = 0;
+
+    if (slot == layer_slot)
+        return;
+    if (slot < 0) {
+        drop_layer();
+        return;
+    }
+    layer_slot = slot;
+    invalidate_layer();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Frame synchronization
+
+
+void free_frame_sync(Client *client) {
+    Client_Cold *cold = client->cold;
+    if (!cold->frame_counter)
+        return;
+    XSyncDestroyAlarm(display, cold->frame_alarm);
+    if (cold->held_damage)
+        merge_damage(cold->held_damage);
+    cold->frame_counter = None;
+    cold->frame_alarm = None;
+    cold->frame_drawing = false;
+    cold->held_damage = 0;
+    cold->frame_done = cold->frame_drawn = -1;
+    frame_sync_clients--;
+}
+
+
+// Starts following the client's frame counter with an alarm that fires on
+// every change of it
+void update_frame_counter(Client *client) {
+    Client_Cold *cold = client->cold;
+    XSyncCounter counter = has_sync ? cold->counter_property : None;
+    if (counter == cold->frame_counter)
+        return;
+    free_frame_sync(client);
+
+    XSyncValue value;
+    if (!counter || !XSyncQueryCounter(display, counter, &value))
+        return;
+
+    XSyncAlarmAttributes attributes;
+    XSyncValue one;
+    Bool overflow;
+    XSyncIntToValue(&one, 1);
+    attributes.trigger.counter = counter;
+    attributes.trigger.value_type = XSyncAbsolute;
+    XSyncValueAdd(&attributes.trigger.wait_value, value, one, &overflow);
+    attributes.trigger.test_type = XSyncPositiveComparison;
+    // Moves the wait value past the counter each time it fires
+    attributes.delta = one;
+    attributes.events = True;
+    cold->frame_alarm = XSyncCreateAlarm(display, XSyncCACounter | XSyncCAValueType | XSyncCAValue |
+                                         XSyncCATestType | XSyncCADelta | XSyncCAEvents, &attributes);
+    cold->frame_counter = counter;
+    cold->frame_drawing = XSyncValueLow32(value) & 1;
+    frame_sync_clients++;
+}
+
+
+// The counter is odd while the client draws a frame and even once it's done
+void frame_counter_changed(XSyncAlarmNotifyEvent *ae) {
+    if (ae->state == XSyncAlarmDestroyed)
+        return;
+    Client *client = NULL;
+    for (size_t i = 0; i < cvector_size(clients) && !client; ++i) {
+        if (clients[i].cold->frame_alarm == ae->alarm)
+            client = &clients[i];
+    }
+    if (!client)
+        return;
+
+    Client_Cold *cold = client->cold;
+    int64_t value = ((int64_t) XSyncValueHigh32(ae->counter_value) << 32) | XSyncValueLow32(ae->counter_value);
+    if (value & 1) {
+        cold->frame_drawing = true;
+        return;
+    }
+    cold->frame_drawing = false;
+    if (cold->held_damage) {
+        merge_damage(cold->held_damage);
+        cold->held_damage = 0;
+        stats.frames_held++;
+    }
+    cold->frame_done = value;
+}
+
+
+void send_frame_message(Client *client, Atom type, int64_t frame, long l2, long l3, long l4) {
+    XClientMessageEvent ev;
+    ev.type = ClientMessage;
+    ev.window = client->cold->client_window;
+    ev.message_type = type;
+    ev.format = 32;
+    ev.data.l[0] = frame & 0xffffffff;
+    ev.data.l[1] = frame >> 32;
+    ev.data.l[2] = l2;
+    ev.data.l[3] = l3;
+    ev.data.l[4] = l4;
+    XSendEvent(display, ev.window, False, 0, (XEvent *) &ev);
+}
+
+
+// `offset` is how long after it was reported drawn the frame was shown, in
+// microseconds, 0 if we don't know
+void send_frame_timings(Client *client, int64_t offset) {
+    uint64_t refresh = DEFAULT_REFRESH_INTERVAL;
+    for (size_t i = 0; i < cvector_size(outputs); ++i) {
+        if (i == 0 || frame_interval(&outputs[i]) < refresh)
+            refresh = frame_interval(&outputs[i]);
+    }
+    if (offset > INT32_MAX)
+        offset = 0;
+    send_frame_message(client, frame_timings_atom, client->cold->frame_drawn, offset, refresh / 1000, 0);
+    client->cold->frame_drawn = -1;
+}
+
+
+// Called once nothing is left to paint, so every finished client frame has
+// made it into ours, or was on a part of the screen nobody can see
+void report_frames_drawn() {
+    if (!frame_sync_clients)
+        return;
+    uint64_t now = now_ns() / 1000;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client *client = &clients[i];
+        Client_Cold *cold = client->cold;
+        if (cold->frame_done < 0)
+            continue;
+        send_frame_message(client, frame_drawn_atom, cold->frame_done, now & 0xffffffff, now >> 32, 0);
+        stats.frames_drawn_sent++;
+        cold->frame_drawn = cold->frame_done;
+        cold->frame_drawn_time = now;
+        cold->frame_done = -1;
+        // Only Present says when a frame was actually shown
+        if (!use_present)
+            send_frame_timings(client, 0);
+    }
+}
+
+
+void report_frame_timings(uint64_t ust) {
+    if (!frame_sync_clients)
+        return;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client_Cold *cold = clients[i].cold;
+        if (cold->frame_drawn < 0)
+            continue;
+        // Zero would say it's unknown
+        int64_t offset = (int64_t) ust - (int64_t) cold->frame_drawn_time;
+        send_frame_timings(&clients[i], offset > 0 ? offset : 1);
+    }
+}
+
+
+// GTK only uses its extended counter when _NET_SUPPORTED says the frame
+// messages are supported. That's the window manager's list, so ours is
+// added to it whenever the window manager sets it without.
+void advertise_frame_sync() {
+    Atom actual_type;
+    int actual_format;
+    unsigned long items_count, bytes_after;
+    unsigned char *prop = NULL;
+
+    if (!has_sync || XGetWindowProperty(display, root_window, net_supported_atom, 0, 4096, false, XA_ATOM,
+                                        &actual_type, &actual_format, &items_count, &bytes_after,
+                                        &prop) != Success || !prop)
+        return;
+    bool listed = false;
+    for (unsigned long i = 0; i < items_count && actual_format == 32 && !listed; i++)
+        listed = ((Atom *) prop)[i] == frame_drawn_atom;
+    XFree(prop);
+    if (!listed && actual_format == 32)
+        XChangeProperty(display, root_window, net_supported_atom, XA_ATOM, 32, PropModeAppend,
+                        (unsigned char *) &frame_drawn_atom, 1);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Present
+
+
+// A back buffer the server is done with, or a new one if the pool isn't full
+Back_Buffer *idle_buffer(Output *output) {
+    Back_Buffer *unused = NULL;
+    for (int i = 0; i < PRESENT_BUFFERS; i++) {
+        Back_Buffer *buffer = &output->buffers[i];
+        if (!buffer->pixmap) {
+            if (!unused)
+                unused = buffer;
+        } else if (buffer->idle) {
+            return buffer;
+        }
+    }
+    if (!unused)
+        return NULL;
+
+    unused->pixmap = XCreatePixmap(display, root_window, output->bounds.width, output->bounds.height,
+                                   XDefaultDepth(display, default_screen));
+    unused->picture = XRenderCreatePicture(display, unused->pixmap,
+                                           XRenderFindVisualFormat(display, XDefaultVisual(display, default_screen)),
+                                           0, NULL);
+    unused->idle = true;
+    unused->frame = 0;
+    return unused;
+}
+
+
+// Whether the output can take another frame. A complete notify that doesn't
+// come (the CRTC was turned off, say) isn't waited for forever.
+bool output_ready(Output *output, uint64_t now) {
+    if (!use_present)
+        return true;
+    if (output->frame_pending && now - output->pending_since < PRESENT_TIMEOUT)
+        return false;
+    output->frame_pending = false;
+    return idle_buffer(output) != NULL;
+}
+
+
+// Shows what root_buffer holds for the output at its next vblank. `update`
+// is what changed in this frame, in screen coordinates, and is taken over.
+void present_output(Output *output, XserverRegion update, uint64_t now) {
+    Back_Buffer *buffer = idle_buffer(output);
+    XRectangle *bounds = &output->bounds;
+
+    XFixesTranslateRegion(display, update, -bounds->x, -bounds->y);
+    if (output->history[PRESENT_BUFFERS - 1])
+        XFixesDestroyRegion(display, output->history[PRESENT_BUFFERS - 1]);
+    memmove(&output->history[1], &output->history[0], sizeof(XserverRegion) * (PRESENT_BUFFERS - 1));
+    output->history[0] = update;
+    output->frame_count++;
+
+    // The buffer is missing the frames since the one it holds
+    XserverRegion copy;
+    unsigned long age = buffer->frame ? output->frame_count - buffer->frame : 0;
+    if (age == 0 || age > PRESENT_BUFFERS) {
+        XRectangle whole = { 0, 0, bounds->width, bounds->height };
+        copy = XFixesCreateRegion(display, &whole, 1);
+    } else {
+        copy = XFixesCreateRegion(display, NULL, 0);
+        for (unsigned long i = 0; i < age; i++)
+            XFixesUnionRegion(display, copy, copy, output->history[i]);
+    }
+    XFixesSetPictureClipRegion(display, buffer->picture, 0, 0, copy);
+    XRenderComposite(display, PictOpSrc, root_buffer, 0, buffer->picture,
+                     bounds->x, bounds->y, 0, 0, 0, 0, bounds->width, bounds->height);
+    XFixesSetPictureClipRegion(display, buffer->picture, 0, 0, None);
+    XFixesDestroyRegion(display, copy);
+
+    output->target_msc = output->last_msc ? output->last_msc + 1 : 0;
+    output->pending_serial = ++present_serial;
+    XPresentPixmap(display, overlay_window, buffer->pixmap, output->pending_serial,
+                   None, update, bounds->x, bounds->y, output->crtc, None, None,
+                   PresentOptionNone, output->target_msc, 0, 0, NULL, 0);
+    buffer->idle = false;
+    buffer->frame = output->frame_count;
+    output->frame_pending = true;
+    output->pending_since = now;
+}
+
+
+// The output's frame made it to the screen, so the next one can be painted
+void present_complete(XPresentCompleteNotifyEvent *ce) {
+    if (ce->kind != PresentCompleteKindPixmap)
+        return;
+    for (size_t i = 0; i < cvector_size(outputs); ++i) {
+        Output *output = &outputs[i];
+        if (!output->frame_pending || output->pending_serial != ce->serial_number)
+            continue;
+        output->frame_pending = false;
+        if ((output->target_msc && ce->msc > output->target_msc) || ce->mode == PresentCompleteModeSkip)
+            stats.missed_vblanks++;
+        output->last_msc = ce->msc;
+        stats.frames_presented++;
+        report_frame_timings(ce->ust);
+        return;
+    }
+}
+
+
+void present_idle(XPresentIdleNotifyEvent *ie) {
+    for (size_t i = 0; i < cvector_size(outputs); ++i) {
+        for (int b = 0; b < PRESENT_BUFFERS; b++) {
+            if (outputs[i].buffers[b].pixmap == ie->pixmap) {
+                outputs[i].buffers[b].idle = true;
+                return;
+            }
+        }
+    }
+}
+
+
+// Puts the output's newly painted part of root_buffer on the screen
+void show_output(Output *output, XserverRegion update, uint64_t now) {
+    if (use_present) {
+        present_output(output, update, now);
+        return;
+    }
+    XFixesSetPictureClipRegion(display, root_picture, 0, 0, update);
+    XRenderComposite(display, PictOpSrc, root_buffer, 0, root_picture,
+                     output->bounds.x, output->bounds.y, 0, 0, output->bounds.x, output->bounds.y,
+                     output->bounds.width, output->bounds.height);
+    XFixesDestroyRegion(display, update);
+}
+
+
+// Counts a frame that took `duration` against the `budget` of the output it
+// was for. The level only changes in govern_quality, between frames.
+void time_frame(uint64_t duration, uint64_t budget) {
+    if (!config.adaptive_quality || budget == 0)
+        return;
+    stats.frames_timed++;
+    quality_frames++;
+    if (duration > budget) {
+        stats.frames_over_budget++;
+        quality_overruns++;
+    }
+    uint64_t load = duration * 1000 / budget;
+    if (load > quality_worst)
+        quality_worst = load;
+}
+
+
+// paint_due_outputs for the OpenGL backend. Everything that has to be drawn
+// is one rectangle, scissored, made of the damage and whatever the back
+// buffer is missing. Returns the number of milliseconds until the next
+// frame is due if there's damage waiting, or -1.
+int paint_gl() {
+    if (!all_damage)
+        return -1;
+    uint64_t now = now_ns();
+    if (now < gl_next_frame)
+        return (gl_next_frame - now + 999999) / 1000000;
+
+    int count;
+    XRectangle bounds;
+    XRectangle *rects = XFixesFetchRegionAndBounds(display, all_damage, &count, &bounds);
+    if (rects)
+        XFree(rects);
+    XFixesDestroyRegion(display, all_damage);
+    all_damage = 0;
+
+    if (!root_tile)
+        root_tile = create_root_tile();
+    if (gl_background_tile != root_tile) {
+        if (gl_background_pixmap) {
+            glx_texture_release(&gl_background);
+            XFreePixmap(display, gl_background_pixmap);
+        }
+        gl_background_pixmap = wallpaper_pixmap();
+        glx_texture_bind(&gl_background, gl_background_pixmap, XDefaultDepth(display, default_screen),
+                         root_width, root_height);
+        gl_background_tile = root_tile;
+    }
+
+    XRectangle area = glx_begin_frame(&bounds);
+    grid_query(&area, 1, &area);
+
+    static cvector(Gl_Quad) quads = NULL;
+    static cvector(XRectangle) clips = NULL;
+    static cvector(int) clip_starts = NULL;
+    cvector_clear(quads);
+    cvector_clear(clips);
+    cvector_clear(clip_starts);
+    for (size_t c = 0; c < cvector_size(paint_candidates); ++c) {
+        Client *w = &clients[paint_candidates[c]];
+        Client_Cold *cold = w->cold;
+        if (!w->damaged || w->occluded)
+            continue;
+        if (!cold->pixmap)
+            cold->pixmap = XCompositeNameWindowPixmap(display, w->window);
+        if (!cold->pixmap)
+            continue;
+
+        if (!cold->texture) {
+            cold->texture = malloc(sizeof(Gl_Texture));
+            if (!cold->texture ||
+                !glx_texture_bind(cold->texture, cold->pixmap, cold->depth,
+                                  w->width + w->border_width * 2, w->height + w->border_width * 2)) {
+                free(cold->texture);
+                cold->texture = NULL;
+                continue;
+            }
+            cold->texture_stale = false;
+        } else if (cold->texture_stale) {
+            glx_texture_refresh(cold->texture);
+            cold->texture_stale = false;
+        }
+
+        Gl_Quad quad;
+        quad.texture = cold->texture;
+        quad.x = w->x;
+        quad.y = w->y;
+        quad.alpha = (double) cold->opacity / OPAQUE;
+        quad.clip = NULL;
+        quad.clip_count = 0;
+        int clip_start = cvector_size(clips);
+        int clip_count = client_clip_rects(w, &clips);
+        if (clip_count == 0)
+            continue;
+        if (clip_count > 0)
+            quad.clip_count = clip_count;
+        cvector_push_back(clip_starts, clip_start);
+        cvector_push_back(quads, quad);
+    }
+    for (size_t i = 0; i < cvector_size(quads); ++i) {
+        if (quads[i].clip_count)
+            quads[i].clip = &clips[clip_starts[i]];
+    }
+
+    glx_paint(&gl_background, quads, cvector_size(quads), &area);
+
+    // With vsync the swap waits for vblank already, only a lower frame
+    // rate cap adds to it
+    uint64_t interval = DEFAULT_REFRESH_INTERVAL;
+    uint64_t refresh = DEFAULT_REFRESH_INTERVAL;
+    uint64_t budget = DEFAULT_REFRESH_INTERVAL;
+    for (size_t i = 0; i < cvector_size(outputs); ++i) {
+        if (i == 0 || frame_interval(&outputs[i]) < interval) {
+            interval = frame_interval(&outputs[i]);
+            refresh = outputs[i].refresh_interval;
+            budget = frame_budget(&outputs[i]);
+        }
+    }
+    // A swap that waits for vblank takes the whole frame however little
+    // was drawn, only frames without vsync say how long drawing takes
+    if (!config.vsync)
+        time_frame(now_ns() - now, budget);
+    gl_next_frame = now + (config.vsync ? interval - refresh : interval);
+    return -1;
+}
+
+
+// Paints the part of all_damage that lies on each output whose next frame is
+// due, and removes it from all_damage. Returns the number of milliseconds until
+// an output that still has damage waiting is due, or -1 if there is none.
+// Damage that isn't on any output is dropped.
+int paint_due_outputs() {
+    if (config.backend == BACKEND_GLX)
+        return paint_gl();
+    choose_layer_client();
+    add_blur_damage();
+    if (!all_damage)
+        return -1;
+
+    int count;
+    XRectangle bounds;
+    XRectangle *rects = XFixesFetchRegionAndBounds(display, all_damage, &count, &bounds);
+
+    // The rectangles painted in this call, for the frame export
+    static cvector(XRectangle) exported = NULL;
+    cvector_clear(exported);
+
+    uint64_t now = now_ns();
+    uint64_t next = UINT64_MAX;
+    uint64_t budget = UINT64_MAX;
+    bool painted = false;
+    for (size_t i = 0; i < cvector_size(outputs); ++i) {
+        Output *output = &outputs[i];
+
+        bool damaged = false;
+        for (int r = 0; r < count && !damaged; r++)
+            damaged = rectangles_intersect(&rects[r], &output->bounds);
+        if (!damaged)
+            continue;
+
+        if (now < output->next_frame) {
+            if (output->next_frame < next)
+                next = output->next_frame;
+            continue;
+        }
+        if (!output_ready(output, now)) {
+            // The complete or idle notify wakes us up, this is just in case
+            if (now + PRESENT_TIMEOUT < next)
+                next = now + PRESENT_TIMEOUT;
+            continue;
+        }
+
+        XserverRegion region = XFixesCreateRegion(display, &output->bounds, 1);
+        XFixesIntersectRegion(display, region, region, all_damage);
+        XserverRegion update = XFixesCreateRegion(display, NULL, 0);
+        XFixesCopyRegion(display, update, region);
+        paint_all(region, &output->bounds, rects, count);
+        show_output(output, update, now);
+
+        if (frame_export_active()) {
+            for (int r = 0; r < count; r++) {
+                XRectangle rect = rects[r];
+                if (clip_rectangle(&rect, &output->bounds))
+                    cvector_push_back(exported, rect);
+            }
+        }
+
+        region = XFixesCreateRegion(display, &output->bounds, 1);
+        XFixesSubtractRegion(display, all_damage, all_damage, region);
+        XFixesDestroyRegion(display, region);
+
+        // With Present the vblank paces the frames already, only a lower
+        // frame rate cap adds to it
+        if (use_present)
+            output->next_frame = now + frame_interval(output) - output->refresh_interval;
+        else
+            output->next_frame = now + frame_interval(output);
+        if (frame_budget(output) < budget)
+            budget = frame_budget(output);
+        painted = true;
+    }
+    if (rects)
+        XFree(rects);
+
+    if (painted && frame_export_active())
+        frame_export_publish(root_buffer_pixmap, exported, cvector_size(exported));
+    else if (painted)
+        XSync(display, False);
+    // Timed up to here, so the server's part of the frame is in it and not
+    // just the time it took us to send the requests
+    if (painted)
+        time_frame(now_ns() - now, budget);
+
+    if (next == UINT64_MAX) {
+        XFixesDestroyRegion(display, all_damage);
+        all_damage = 0;
+        return -1;
+    }
+    return (next - now + 999999) / 1000000;
+}
+
+
+// Makes thumbnails of the mapped clients damaged since their last one, at
+// most thumbnail_rate a second each so a video doesn't keep the server busy
+// scaling. Returns the number of milliseconds until a damaged client may
+// have its next one, or -1 if there is none.
+int update_thumbnails() {
+    // Unredirected windows have no contents of their own to scale
+    if (!thumbnails_active() || unredirected)
+        return -1;
+
+    uint64_t now = now_ns();
+    uint64_t interval = 1000000000ull / config.thumbnail_rate;
+    uint64_t next = UINT64_MAX;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client *w = &clients[i];
+        Client_Cold *cold = w->cold;
+        // Menus and tooltips don't get thumbnails
+        if (!cold->thumbnail_dirty || !w->damaged || cold->map_state != IsViewable ||
+            cold->override_redirect)
+            continue;
+        if (now < cold->thumbnail_due) {
+            if (cold->thumbnail_due < next)
+                next = cold->thumbnail_due;
+            continue;
+        }
+        // When the table is full the window just goes without
+        thumbnails_update(w->window, client_picture(w),
+                          w->width + w->border_width * 2, w->height + w->border_width * 2);
+        cold->thumbnail_dirty = false;
+        cold->thumbnail_due = now + interval;
+    }
+    thumbnails_flush();
+
+    if (next == UINT64_MAX)
+        return -1;
+    return (next - now + 999999) / 1000000;
+}
+
+
+void finish_unmap_client(Client *client) {
+    client->damaged = 0;
+    if (client->slot == layer_slot)
+        drop_layer();
+
+    if (client->extents != 0) {
+        add_damage(client->extents);    /* destroys region */
+        client->extents = 0;
+    }
+
+    if (client->cold->pixmap) {
+        XFreePixmap(display, client->cold->pixmap);
+        client->cold->pixmap = 0;
+    }
+
+    if (client->picture) {
+        XRenderFreePicture(display, client->picture);
+        client->picture = 0;
+    }
+    free_blur_cache(client);
+    free_client_surface(client);
+    free_client_texture(client);
+    free_frame_sync(client);
+
+    if (client->border_size) {
+        XFixesDestroyRegion(display, client->border_size);
+        client->border_size = 0;
+    }
+    if (client->border_clip) {
+        XFixesDestroyRegion(display, client->border_clip);
+        client->border_clip = 0;
+    }
+
+    clip_changed = true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+
+
+Client *get_client_from_window(Window id) {
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].window == id)
+            return &clients[i];
+    }
+    return NULL;
+}
+
+
+void unmap_win(Window window) {
+    unsigned long start = XNextRequest(display);
+    Client *client = get_client_from_window(window);
+    if (!client) return;
+    client->cold->map_state = IsUnmapped;
+    grid_update(client);
+
+    finish_unmap_client(client);
+
+    /* don't care about properties anymore */
+    XSelectInput(display, client->window, 0);
+    client->cold->requests += XNextRequest(display) - start;
+}
+
+
+// A 1x1 repeating alpha mask, used to paint a window at a given opacity
+Picture solid_picture(double alpha) {
+    Pixmap pixmap = XCreatePixmap(display, root_window, 1, 1, 8);
+    XRenderPictureAttributes pa;
+    pa.repeat = true;
+    Picture picture = XRenderCreatePicture(display, pixmap,
+                                           XRenderFindStandardFormat(display, PictStandardA8),
+                                           CPRepeat, &pa);
+    XRenderColor c;
+    c.red = c.green = c.blue = 0;
+    c.alpha = alpha * 0xffff;
+    XRenderFillRectangle(display, PictOpSrc, picture, &c, 0, 0, 1, 1);
+    XFreePixmap(display, pixmap);
+    return picture;
+}
+
+
+// Rules are looked up by class and instance name in a hash table built
+// when the config is loaded, and a client's rule is only looked up again
+// when its WM_CLASS changes
+typedef struct Rule_Entry {
+    const char *name;   // the rule's class_name, NULL for an empty entry
+    int rule;           // index into config.rules
+} Rule_Entry;
+
+Rule_Entry *rule_table = NULL;
+size_t rule_table_size;
+
+
+unsigned long hash_name(const char *name) {
+    // FNV-1a
+    unsigned long hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash;
+}
+
+
+void compile_rules() {
+    free(rule_table);
+    rule_table_size = 16;
+    while (rule_table_size < cvector_size(config.rules) * 2)
+        rule_table_size *= 2;
+    rule_table = calloc(rule_table_size, sizeof(Rule_Entry));
+
+    for (size_t i = 0; i < cvector_size(config.rules); ++i) {
+        const char *name = config.rules[i].class_name;
+        size_t index = hash_name(name) & (rule_table_size - 1);
+        while (rule_table[index].name && strcmp(rule_table[index].name, name))
+            index = (index + 1) & (rule_table_size - 1);
+        // The first rule for a name is the one that's used
+        if (!rule_table[index].name) {
+            rule_table[index].name = name;
+            rule_table[index].rule = i;
+        }
+    }
+}
+
+
+int find_rule(const char *name) {
+    size_t index = hash_name(name) & (rule_table_size - 1);
+    for (; rule_table[index].name; index = (index + 1) & (rule_table_size - 1)) {
+        if (!strcmp(rule_table[index].name, name))
+            return rule_table[index].rule;
+    }
+    return -1;
+}
+
+
+// Returns whether the client's rule changed
+bool update_client_rule(Client *client) {
+    Client_Cold *cold = client->cold;
+    int rule = -1;
+    if (cold->class_name) {
+        int by_class = find_rule(cold->class_name);
+        int by_instance = find_rule(cold->instance_name);
+        rule = by_class < 0 || (by_instance >= 0 && by_instance < by_class) ? by_instance : by_class;
+    }
+    if (rule == cold->rule)
+        return false;
+    cold->rule = rule;
+    return true;
+}
+
+
+const Window_Rule *match_rule(Client *client) {
+    return client->cold->rule >= 0 ? &config.rules[client->cold->rule] : NULL;
+}
+
+
+// Asks for a property without waiting for it. The replies are collected in
+// one go by collect_properties, so the windows mapped in a batch of events
+// cost one round trip for all of them instead of one each.
+void request_property(Window frame, Window window, enum Cached_Property property) {
+    Property_Fetch fetch;
+    fetch.frame = frame;
+    fetch.window = window;
+    fetch.property = property;
+    fetch.cookie = xcb_get_property(connection, 0, window, property_atoms[property],
+                                    property_types[property], 0, property_lengths[property]);
+    cvector_push_back(property_fetches, fetch);
+    stats.property_fetches++;
+}
+
+
+void request_client_properties(Client *client) {
+    Window window = client->cold->client_window;
+    request_property(client->window, window, PROPERTY_CLASS);
+    request_property(client->window, client->window, PROPERTY_OPACITY);
+    request_property(client->window, window, PROPERTY_STATE);
+    if (has_sync)
+        request_property(client->window, window, PROPERTY_FRAME_COUNTER);
+}
+
+
+void request_root_properties() {
+    request_property(None, root_window, PROPERTY_ROOT_PIXMAP);
+    request_property(None, root_window, PROPERTY_SETROOT_PIXMAP);
+}
+
+
+// Puts a reply into the cache, and notes what changed for
+// apply_property_changes. A missing property comes back with no value.
+void store_property(const Property_Fetch *fetch, xcb_get_property_reply_t *reply) {
+    int length = 0;
+    const void *value = NULL;
+    if (reply && reply->type == property_types[fetch->property] &&
+        reply->format == (fetch->property == PROPERTY_CLASS ? 8 : 32)) {
+        length = xcb_get_property_value_length(reply);
+        value = xcb_get_property_value(reply);
+    }
+
+    if (fetch->frame == None) {
+        int which = fetch->property - PROPERTY_ROOT_PIXMAP;
+        Pixmap pixmap = length >= 4 ? *(const uint32_t *) value : None;
+        if (pixmap != root_pixmaps[which]) {
+            root_pixmaps[which] = pixmap;
+            wallpaper_changed = true;
+        }
+        return;
+    }
+
+    Client *client = get_client_from_window(fetch->frame);
+    if (!client || client->cold->map_state != IsViewable)
+        return;
+    Client_Cold *cold = client->cold;
+    // Asked for before the window manager reparented it somewhere else
+    if (fetch->window != (fetch->property == PROPERTY_OPACITY ? client->window : cold->client_window))
+        return;
+
+    bool changed = false;
+    switch (fetch->property) {
+        case PROPERTY_CLASS: {
+            // "instance\0class\0", either may be missing its terminator
+            char *instance = NULL, *class_name = NULL;
+            if (value) {
+                instance = strndup(value, length);
+                size_t skip = strlen(instance) + 1;
+                class_name = strndup((const char *) value + (skip < (size_t) length ? skip : length),
+                                     skip < (size_t) length ? length - skip : 0);
+            }
+            changed = (instance == NULL) != (cold->instance_name == NULL) ||
+                (instance && (strcmp(instance, cold->instance_name) || strcmp(class_name, cold->class_name)));
+            free(cold->instance_name);
+            free(cold->class_name);
+            cold->instance_name = instance;
+            cold->class_name = class_name;
+            break;
+        }
+        case PROPERTY_OPACITY: {
+            unsigned int opacity = length >= 4 ? *(const uint32_t *) value : OPAQUE;
+            changed = opacity != cold->property_opacity;
+            cold->property_opacity = opacity;
+            break;
+        }
+        case PROPERTY_FRAME_COUNTER: {
+            // The second counter is the extended one, the first is for
+            // the window manager's resize requests
+            XSyncCounter counter = length >= 8 ? ((const uint32_t *) value)[1] : None;
+            changed = counter != cold->counter_property;
+            cold->counter_property = counter;
+            break;
+        }
+        case PROPERTY_STATE: {
+            bool fullscreen = false;
+            for (int i = 0; i < length / 4 && !fullscreen; i++)
+                fullscreen = ((const uint32_t *) value)[i] == fullscreen_atom;
+            changed = fullscreen != cold->fullscreen;
+            cold->fullscreen = fullscreen;
+            break;
+        }
+        default:
+            break;
+    }
+    if (changed) {
+        cold->property_changes |= 1 << fetch->property;
+        property_changes = true;
+    }
+}
+
+
+// We want to hear about property changes while it's mapped, on the frame
+// and on the window the application set them on inside it
+void watch_client_properties(Client *client) {
+    XSelectInput(display, client->window, PropertyChangeMask);
+    if (client->cold->client_window != client->window)
+        XSelectInput(display, client->cold->client_window, PropertyChangeMask);
+}
+
+
+// Reparenting window managers put the application's window (the one with
+// WM_STATE, WM_CLASS and friends) inside a frame, and the frame is what we
+// see as a child of the root. The frame is searched for it a level at a
+// time by walk_frames, this queues one window of the search.
+void walk_frame(Client *client, Window window) {
+    Frame_Walk walk;
+    walk.frame = client->window;
+    walk.window = window;
+    walk.state = xcb_get_property(connection, 0, window, wm_state_atom, XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+    walk.tree = xcb_query_tree(connection, window);
+    cvector_push_back(frame_walks, walk);
+    client->cold->walks_pending++;
+}
+
+
+// The search is over, the client's properties can be asked for
+void found_client_window(Client *client, Window window) {
+    client->cold->client_window = window;
+    watch_client_properties(client);
+    request_client_properties(client);
+}
+
+
+// Takes in the replies for one level of the frames being searched and
+// queues the next. The first window of a level with WM_STATE is the one,
+// and a frame with nothing of that kind in it stands for itself.
+void walk_frames(const Frame_Walk *level) {
+    for (size_t i = 0; i < cvector_size(level); ++i) {
+        const Frame_Walk *walk = &level[i];
+        xcb_generic_error_t *error = NULL;
+        xcb_get_property_reply_t *state = xcb_get_property_reply(connection, walk->state, &error);
+        free(error);
+        error = NULL;
+
+        Client *client = get_client_from_window(walk->frame);
+        if (client)
+            client->cold->walks_pending--;
+        // Unmapped again, or found in another window of this level
+        bool searching = client && client->cold->map_state == IsViewable && !client->cold->client_window;
+        if (searching && state && state->type != XCB_NONE) {
+            found_client_window(client, walk->window);
+            searching = false;
+        }
+        free(state);
+
+        if (!searching) {
+            xcb_discard_reply(connection, walk->tree.sequence);
+            continue;
+        }
+        xcb_query_tree_reply_t *tree = xcb_query_tree_reply(connection, walk->tree, &error);
+        free(error);
+        if (tree) {
+            xcb_window_t *children = xcb_query_tree_children(tree);
+            int count = xcb_query_tree_children_length(tree);
+            for (int j = 0; j < count; j++)
+                walk_frame(client, children[j]);
+            free(tree);
+        }
+        if (!client->cold->walks_pending)
+            found_client_window(client, client->window);
+    }
+}
+
+
+// Waits for everything asked for since the last call. Each level of the
+// frames being searched costs one more round trip, but it's one for every
+// window mapped in the batch, and the properties of the windows found are
+// asked for on the way.
+void collect_properties() {
+    static cvector(Frame_Walk) level = NULL;
+    while (!cvector_empty(frame_walks) || !cvector_empty(property_fetches)) {
+        stats.property_round_trips++;
+
+        cvector(Frame_Walk) walks = frame_walks;
+        frame_walks = level;
+        level = walks;
+        cvector_clear(frame_walks);
+        walk_frames(level);
+
+        for (size_t i = 0; i < cvector_size(property_fetches); ++i) {
+            xcb_generic_error_t *error = NULL;
+            xcb_get_property_reply_t *reply = xcb_get_property_reply(connection, property_fetches[i].cookie, &error);
+            store_property(&property_fetches[i], reply);
+            free(reply);
+            free(error);
+        }
+        cvector_clear(property_fetches);
+    }
+}
+
+
+// The window's own _NET_WM_WINDOW_OPACITY wins over the config's class rules
+unsigned int client_opacity(Client *client) {
+    if (config.window_opacity && client->cold->property_opacity != OPAQUE)
+        return client->cold->property_opacity;
+
+    const Window_Rule *rule = match_rule(client);
+    if (rule && rule->opacity >= 0)
+        return rule->opacity * OPAQUE;
+    return OPAQUE;
+}
+
+
+// Blur is opted into by a rule, and there's only something to blur when the
+// window lets the background through
+void update_client_blur(Client *client) {
+    const Window_Rule *rule = match_rule(client);
+    // Blur is left to XRender, the other backends don't do it
+    bool blur = client->opaqueness != SOLID && rule && rule->blur > 0 &&
+        config.backend == BACKEND_XRENDER && quality_level < QUALITY_NO_BLUR;
+    if (blur == client->blur)
+        return;
+
+    client->blur = blur;
+    free_blur_cache(client);
+    client->cold->blur_dirty.width = client->cold->blur_dirty.height = 0;
+    clip_changed = true;
+    if (client->extents) {
+        XserverRegion damage = XFixesCreateRegion(display, NULL, 0);
+        XFixesCopyRegion(display, damage, client->extents);
+        add_damage(damage);
+    }
+}
+
+
+// The corners are rounded by the radius a rule or the config gives, as far
+// as the window is big enough for. Shaped windows have corners of their own
+// and fullscreen ones none, whether they say so in _NET_WM_STATE or just
+// cover the screen. Kept in the client so the paint passes don't
+// have to work it out.
+void update_corner_radius(Client *client) {
+    const Window_Rule *rule = match_rule(client);
+    int radius = rule && rule->corner_radius >= 0 ? rule->corner_radius : config.corner_radius;
+
+    int wid = client->width + client->border_width * 2;
+    int hei = client->height + client->border_width * 2;
+    if (client->cold->shaped || client->cold->fullscreen || quality_level >= QUALITY_NO_CORNERS ||
+        (client->x <= 0 && client->y <= 0 && client->x + wid >= root_width && client->y + hei >= root_height))
+        radius = 0;
+    if (radius * 2 > wid)
+        radius = wid / 2;
+    if (radius * 2 > hei)
+        radius = hei / 2;
+    if (radius == client->corner_radius)
+        return;
+
+    client->corner_radius = radius;
+    clip_changed = true;
+    if (client->extents) {
+        XserverRegion damage = XFixesCreateRegion(display, NULL, 0);
+        XFixesCopyRegion(display, damage, client->extents);
+        add_damage(damage);
+    }
+}
+
+
+void set_quality_level(enum Quality_Level level) {
+    uint64_t now = now_ns();
+    quality_level_ns[quality_level] += now - quality_level_since;
+    quality_level_since = now;
+    if (level > quality_level)
+        stats.quality_downgrades++;
+    else
+        stats.quality_upgrades++;
+    quality_level = level;
+
+    // The frame rate follows with each output's next frame
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].cold->map_state == IsViewable) {
+            update_client_blur(&clients[i]);
+            update_corner_radius(&clients[i]);
+        }
+    }
+}
+
+
+// Steps the quality down one level when too many frames of the last window
+// went over budget, and up one once there has been plenty of headroom for a
+// while
+void govern_quality() {
+    if (!config.adaptive_quality) {
+        if (quality_level != QUALITY_FULL)
+            set_quality_level(QUALITY_FULL);
+        quality_frames = quality_overruns = quality_worst = quality_good_windows = 0;
+        return;
+    }
+    if (quality_frames < QUALITY_WINDOW)
+        return;
+
+    bool overrun = quality_overruns * 4 > quality_frames;
+    bool headroom = quality_worst <= 500;
+    quality_frames = quality_overruns = quality_worst = 0;
+
+    if (overrun) {
+        quality_good_windows = 0;
+        if (quality_level < QUALITY_HALF_RATE)
+            set_quality_level(quality_level + 1);
+    } else if (!headroom) {
+        quality_good_windows = 0;
+    } else if (quality_level > QUALITY_FULL && ++quality_good_windows >= QUALITY_RECOVERY_WINDOWS) {
+        quality_good_windows = 0;
+        set_quality_level(quality_level - 1);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Memory budget
+
+
+// Summed over the clients by enforce_memory_budget
+unsigned long memory_held;
+unsigned long memory_named;     // window pixmaps we hold a name for
+
+
+// Bytes per pixel of a pixmap of `depth` as the server stores it
+int depth_bytes(int depth) {
+    return depth > 16 ? 4 : depth > 8 ? 2 : 1;
+}
+
+
+// What the client's caches take, estimated from its size: the blur cache,
+// the software backend's copy and the texture, which most drivers keep
+// apart from the pixmap. The window pixmap itself isn't counted, the server
+// keeps it for as long as the window is mapped and redirected whether we
+// hold a name for it or not.
+unsigned long client_memory(const Client *client) {
+    const Client_Cold *cold = client->cold;
+    XRectangle whole = client_rect(client);
+    unsigned long pixels = rectangle_area(&whole);
+    unsigned long bytes = 0;
+    if (cold->blur_cache)
+        bytes += pixels * 4;
+    if (cold->surface)
+        bytes += cold->surface->size;
+    if (cold->texture)
+        bytes += pixels * 4;
+    return bytes;
+}
+
+
+// Lets go of everything held for the client's contents. All of it is made
+// again when the client is painted: client_picture names the pixmap again,
+// and the caches start out with all of them out of date.
+void evict_client(Client *client) {
+    Client_Cold *cold = client->cold;
+    stats.evictions++;
+    stats.evicted_bytes += cold->memory;
+    cold->memory = 0;
+
+    free_blur_cache(client);
+    free_client_surface(client);
+    free_client_texture(client);
+    if (client->picture) {
+        XRenderFreePicture(display, client->picture);
+        client->picture = 0;
+    }
+    if (cold->pixmap) {
+        XFreePixmap(display, cold->pixmap);
+        cold->pixmap = 0;
+    }
+}
+
+
+int compare_last_visible(const void *a, const void *b) {
+    uint64_t x = clients[*(const int *) a].cold->last_visible;
+    uint64_t y = clients[*(const int *) b].cold->last_visible;
+    return x < y ? -1 : x > y;
+}
+
+
+// Adds up what every client holds, and when it's over the budget evicts
+// occluded clients, the ones hidden the longest first, until it fits.
+// Unmapped clients have given everything up already, see
+// finish_unmap_client. Visible clients are never evicted, they'd only be
+// made again for the next frame.
+void enforce_memory_budget() {
+    if (clip_changed)
+        update_visibility();
+
+    uint64_t now = now_ns();
+    memory_held = memory_named = 0;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client *client = &clients[i];
+        Client_Cold *cold = client->cold;
+        if (!client->occluded)
+            cold->last_visible = now;
+        cold->memory = client_memory(client);
+        memory_held += cold->memory;
+        if (cold->pixmap) {
+            XRectangle whole = client_rect(client);
+            memory_named += rectangle_area(&whole) * depth_bytes(cold->depth);
+        }
+    }
+
+    unsigned long budget = (unsigned long) config.memory_budget << 20;
+    if (!config.memory_budget || memory_held <= budget)
+        return;
+
+    static cvector(int) hidden = NULL;
+    cvector_clear(hidden);
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].occluded && clients[i].cold->memory)
+            cvector_push_back(hidden, i);
+    }
+    qsort(hidden, cvector_size(hidden), sizeof(int), compare_last_visible);
+    for (size_t i = 0; i < cvector_size(hidden) && memory_held > budget; ++i) {
+        memory_held -= clients[hidden[i]].cold->memory;
+        evict_client(&clients[hidden[i]]);
+    }
+}
+
+
+void determine_opaqueness(Client *client) {
+    XRenderPictFormat *format;
+
+    if (client->alpha_pict) {
+        XRenderFreePicture(display, client->alpha_pict);
+        client->alpha_pict = 0;
+    }
+
+    if (client->cold->class == InputOnly) {
+        format = NULL;
+    } else {
+        format = XRenderFindVisualFormat(display, client->cold->visual);
+    }
+
+    enum Window_Opaqueness opaqueness;
+    if (client->cold->opacity != OPAQUE) {
+        opaqueness = TRANSPARENT;
+        client->alpha_pict = solid_picture((double) client->cold->opacity / OPAQUE);
+    } else if (format && format->type == PictTypeDirect && format->direct.alphaMask) {
+        opaqueness = ARGB;
+    } else {
+        opaqueness = SOLID;
+    }
+    if (client->opaqueness != opaqueness)
+        clip_changed = true;
+    client->opaqueness = opaqueness;
+    if (client->extents) {
+        XserverRegion damage;
+        damage = XFixesCreateRegion(display, NULL, 0);
+        XFixesCopyRegion(display, damage, client->extents);
+        add_damage(damage);
+    }
+    update_client_blur(client);
+    update_corner_radius(client);
+}
+
+// Re-evaluates the opacity of a mapped client and repaints it if it changed
+void update_client_opacity(Client *client) {
+    unsigned int opacity = client_opacity(client);
+    if (opacity == client->cold->opacity)
+        return;
+    client->cold->opacity = opacity;
+    determine_opaqueness(client);
+}
+
+
+// Acts on what store_property found changed. Everything that depends on
+// the rule is only looked at again when WM_CLASS changes.
+void apply_property_changes() {
+    if (wallpaper_changed) {
+        wallpaper_changed = false;
+        if (root_tile) {
+            XRenderFreePicture(display, root_tile);
+            root_tile = 0;
+            damage_screen();
+        }
+    }
+    if (!property_changes)
+        return;
+    property_changes = false;
+
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client *client = &clients[i];
+        unsigned char changes = client->cold->property_changes;
+        if (!changes)
+            continue;
+        client->cold->property_changes = 0;
+
+        bool rule_changed = (changes & 1 << PROPERTY_CLASS) && update_client_rule(client);
+        if (rule_changed || (changes & 1 << PROPERTY_OPACITY))
+            update_client_opacity(client);
+        if (rule_changed)
+            update_client_blur(client);
+        if (rule_changed || (changes & 1 << PROPERTY_STATE))
+            update_corner_radius(client);
+        if (changes & 1 << PROPERTY_FRAME_COUNTER)
+            update_frame_counter(client);
+    }
+}
+
+
+// ShapeNotify only tells us about changes, so whether the window starts out
+// shaped is asked once when it's mapped
+void query_shape(Client *client) {
+    Client_Cold *cold = client->cold;
+    Bool bounding_shaped, clip_shaped;
+    int xb, yb, xc, yc;
+    unsigned int wb, hb, wc, hc;
+
+    if (cold->class == InputOnly ||
+        !XShapeQueryExtents(display, client->window, &bounding_shaped, &xb, &yb, &wb, &hb,
+                            &clip_shaped, &xc, &yc, &wc, &hc))
+        return;
+
+    cold->shaped = bounding_shaped;
+    cold->shape_stale = bounding_shaped;
+    if (bounding_shaped) {
+        cold->shape_bounds.x = client->x + xb;
+        cold->shape_bounds.y = client->y + yb;
+        cold->shape_bounds.width = wb;
+        cold->shape_bounds.height = hb;
+    }
+    invalidate_border_size(client);
+}
+
+
+// Fills in what the CreateNotify didn't tell us and starts listening to the
+// window's damage and shape
+void apply_attributes(Client *client, const XWindowAttributes *attr) {
+    Client_Cold *cold = client->cold;
+    cold->visual = attr->visual;
+    cold->depth = attr->depth;
+    cold->class = attr->class;
+    cold->override_redirect = attr->override_redirect;
+    if (attr->class == InputOnly) {
+        cold->damage = 0;
+    } else {
+        cold->damage = XDamageCreate(display, client->window, cold->damage_level);
+        XShapeSelectInput(display, client->window, ShapeNotifyMask);
+    }
+    cold->materialized = true;
+}
+
+
+bool materialize_client(Client *client) {
+    XWindowAttributes attr;
+    if (!XGetWindowAttributes(display, client->window, &attr))
+        return false; // it's already gone, the DestroyNotify is on its way
+    apply_attributes(client, &attr);
+    return true;
+}
+
+
+// Empties the property cache of a client that's being mapped again. What
+// the new fetches find is then all news to apply_property_changes.
+void forget_client_properties(Client *client) {
+    Client_Cold *cold = client->cold;
+    free(cold->class_name);
+    free(cold->instance_name);
+    cold->class_name = NULL;
+    cold->instance_name = NULL;
+    cold->property_opacity = OPAQUE;
+    cold->counter_property = None;
+    cold->fullscreen = false;
+}
+
+
+// The rest of mapping a client, from what's in its property cache
+void show_client(Client *client) {
+    Client_Cold *cold = client->cold;
+    cold->property_changes = 0;
+    update_client_rule(client);
+    update_frame_counter(client);
+    cold->opacity = client_opacity(client);
+
+    determine_opaqueness(client);
+    client->damaged = 0;
+}
+
+
+void map_win(Window window) {
+    unsigned long start = XNextRequest(display);
+    Client *client = get_client_from_window(window);
+
+    if (!client) return;
+    if (!client->cold->materialized && !materialize_client(client))
+        return;
+
+    client->cold->map_state = IsViewable;
+    grid_update(client);
+    clip_changed = true;
+
+    // Shown with the defaults for now. The search for the client window
+    // and its properties are waited for with the rest of the batch's, by
+    // collect_properties, before the next frame is painted, and
+    // apply_property_changes sorts out the rule, opacity and the rest.
+    Client_Cold *cold = client->cold;
+    cold->client_window = None;
+    forget_client_properties(client);
+    XSelectInput(display, window, PropertyChangeMask);
+    walk_frame(client, window);
+    query_shape(client);
+    show_client(client);
+    client->cold->requests += XNextRequest(display) - start;
+}
+
+
+// Starts tracking a window we only know the geometry of. Everything that
+// costs a request is put off until it's mapped, since many windows (menus,
+// tooltips, drag icons) are destroyed again without ever being shown.
+Client *track_client(Window window, int x, int y, int width, int height, int border_width,
+                     Bool override_redirect) {
+    Client_Cold *cold = (Client_Cold *)malloc(sizeof(Client_Cold));
+    if (!cold) {
+        // Memory allocation failed
+        return NULL;
+    }
+
+    cold->materialized = false;
+    cold->requests = 0;
+    cold->visual = NULL;
+    cold->depth = 0;
+    cold->class = InputOutput;
+    cold->map_state = IsUnmapped;
+    cold->override_redirect = override_redirect;
+    cold->damage = 0;
+    cold->pixmap = 0;
+    cold->shaped = false;
+    cold->shape_stale = false;
+    cold->shape_rects = NULL;
+    cold->shape_rect_count = 0;
+    cold->shape_bounds.x = x;
+    cold->shape_bounds.y = y;
+    cold->shape_bounds.width = width;
+    cold->shape_bounds.height = height;
+    cold->grid_x0 = cold->grid_y0 = cold->grid_x1 = cold->grid_y1 = 0;
+    cold->client_window = 0;
+    cold->walks_pending = 0;
+    cold->class_name = NULL;
+    cold->instance_name = NULL;
+    cold->property_opacity = OPAQUE;
+    cold->counter_property = None;
+    cold->fullscreen = false;
+    cold->property_changes = 0;
+    cold->rule = -1;
+    cold->opacity = OPAQUE;
+    cold->visible = NULL;
+    cold->fully_visible = false;
+    cold->visible_region = 0;
+    cold->blur_cache = 0;
+    cold->damage_events = 0;
+    cold->blur_dirty.x = cold->blur_dirty.y = 0;
+    cold->blur_dirty.width = cold->blur_dirty.height = 0;
+    cold->damage_level = XDamageReportNonEmpty;
+    cold->level_votes = 0;
+    cold->level_updates = 0;
+    cold->level_area = 0;
+    cold->level_since = now_ns();
+    cold->thumbnail_dirty = false;
+    cold->thumbnail_due = 0;
+    cold->surface = NULL;
+    cold->surface_dirty.width = cold->surface_dirty.height = 0;
+    cold->texture = NULL;
+    cold->texture_stale = false;
+    cold->slept_damage = false;
+    cold->debug_damage = 0;
+    cold->memory = 0;
+    cold->last_visible = now_ns();
+    cold->frame_counter = None;
+    cold->frame_alarm = None;
+    cold->frame_drawing = false;
+    cold->held_damage = 0;
+    cold->frame_done = cold->frame_drawn = -1;
+    cold->frame_drawn_time = 0;
+
+    Client client;
+    client.window = window;
+    client.picture = 0;
+    client.alpha_pict = 0;
+    client.border_size = 0;
+    client.extents = 0;
+    client.border_clip = 0;
+    client.x = x;
+    client.y = y;
+    client.width = width;
+    client.height = height;
+    client.border_width = border_width;
+    client.opaqueness = SOLID;
+    client.damaged = 0;
+    client.occluded = 0;
+    client.blur = 0;
+    client.corner_radius = 0;
+    client.slot = allocate_slot();
+    client.cold = cold;
+
+    // Add the new client to the beginning of the vector
+    cvector_insert(clients, 0, client);
+    slot_index_dirty = true;
+    clip_changed = true;
+    return &clients[0];
+}
+
+
+void create_client(XCreateWindowEvent *ce) {
+    track_client(ce->window, ce->x, ce->y, ce->width, ce->height, ce->border_width,
+                 ce->override_redirect);
+}
+
+
+// For windows that may already be mapped: the ones found at startup or
+// while resyncing the stack, and ones reparented to the root
+void add_client(Window window) {
+    unsigned long start = XNextRequest(display);
+    XWindowAttributes attr;
+
+    // Get window attributes
+    if (!XGetWindowAttributes(display, window, &attr))
+        return;
+
+    Client *client = track_client(window, attr.x, attr.y, attr.width, attr.height,
+                                  attr.border_width, attr.override_redirect);
+    if (!client)
+        return;
+    apply_attributes(client, &attr);
+    client->cold->requests = XNextRequest(display) - start;
+
+    if (attr.map_state == IsViewable) {
+        map_win(window);
+    }
+}
+
+
+
+
+// Moves the client at index `from` so that it ends up at index `to`
+void move_client(size_t from, size_t to) {
+    if (from == to)
+        return;
+    Client client = clients[from];
+    cvector_erase(clients, from);
+    cvector_insert(clients, to, client);
+    slot_index_dirty = true;
+    invalidate_layer();
+}
+
+
+// Places moving_window directly above target_window, or at the very bottom
+// when target_window is 0. If either of them isn't known the order is left
+// alone and false is returned, since we clearly missed something.
+bool restack_win(Window moving_window, Window target_window) {
+    int moving_index = -1;
+    int target_index = -1;
+
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].window == moving_window)
+            moving_index = i;
+        else if (target_window != 0 && clients[i].window == target_window)
+            target_index = i;
+    }
+
+    if (moving_index == -1)
+        return false;
+
+    if (target_window == 0) {
+        move_client(moving_index, cvector_size(clients) - 1);
+        return true;
+    }
+    if (target_index == -1)
+        return false;
+
+    // The target shifts up by one once the moving client is taken out above it
+    if (target_index > moving_index)
+        target_index--;
+    move_client(moving_index, target_index);
+    return true;
+}
+
+
+void configure_client(XConfigureEvent *ce) {
     Client *client = get_client_from_window(ce->window);
 
     if (client == NULL) {
-        if (ce->window == root_window) {
+        if (ce->window != root_window) {
+            stacking_suspect = true;
+        } else {
             if (root_buffer != 0) {
                 XRenderFreePicture(display, root_buffer);
+                XFreePixmap(display, root_buffer_pixmap);
                 root_buffer = 0;
+                root_buffer_pixmap = 0;
             }
+            free_overdraw();
             root_width = ce->width;
             root_height = ce->height;
+            free_blur_levels();
+            drop_layer();
+            // Consumers get a ring of the new size when they reconnect
+            frame_export_reset();
+            free_software_frame();
+            if (config.backend == BACKEND_GLX) {
+                glx_resize(root_width, root_height);
+                gl_background_tile = 0;
+            }
+            update_outputs();
+            grid_rebuild();
+            clip_changed = true;
         }
         return;
     }
@@ -515,157 +3514,753 @@ void configure_client(XConfigureEvent *ce) {
     if (client->extents != 0)
         XFixesCopyRegion(display, damage, client->extents);
 
-    client->shape_bounds.x -= client->attr.x;
-    client->shape_bounds.y -= client->attr.y;
-    client->attr.x = ce->x;
-    client->attr.y = ce->y;
-    if (client->attr.width != ce->width || client->attr.height != ce->height) {
-        if (client->pixmap) {
-            XFreePixmap(display, client->pixmap);
-            client->pixmap = 0;
+    client->cold->shape_bounds.x -= client->x;
+    client->cold->shape_bounds.y -= client->y;
+    client->x = ce->x;
+    client->y = ce->y;
+    if (client->width != ce->width || client->height != ce->height) {
+        free_blur_cache(client);
+        free_client_surface(client);
+        free_client_texture(client);
+        if (client->cold->pixmap) {
+            XFreePixmap(display, client->cold->pixmap);
+            client->cold->pixmap = 0;
             if (client->picture) {
                 XRenderFreePicture(display, client->picture);
                 client->picture = 0;
             }
         }
     }
-    client->attr.width = ce->width;
-    client->attr.height = ce->height;
-    client->attr.border_width = ce->border_width;
-    client->attr.override_redirect = ce->override_redirect;
+    client->width = ce->width;
+    client->height = ce->height;
+    client->border_width = ce->border_width;
+    client->cold->override_redirect = ce->override_redirect;
+    grid_update(client);
+    invalidate_border_size(client);
+    update_corner_radius(client);
+
+    if (damage) {
+        // The cached extents are kept up to date here rather than being thrown
+        // away with the rest of the regions when the clip changes
+        XserverRegion extents = client_extents(client);
+        XFixesUnionRegion(display, damage, damage, extents);
+        if (client->extents)
+            XFixesDestroyRegion(display, client->extents);
+        client->extents = extents;
+        add_damage(damage);
+    }
+    client->cold->shape_bounds.x += client->x;
+    client->cold->shape_bounds.y += client->y;
+    if (!client->cold->shaped) {
+        client->cold->shape_bounds.width = client->width;
+        client->cold->shape_bounds.height = client->height;
+    }
+
+    // This moves clients around in the vector, so `client` is stale after it
+    if (!restack_win(ce->window, ce->above))
+        stacking_suspect = true;
+
+    clip_changed = true;
+}
+
+
+void circulate_client(XCirculateEvent *ce) {
+    size_t i;
+    for (i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].window == ce->window)
+            break;
+    }
+    if (i == cvector_size(clients)) {
+        stacking_suspect = true;
+        return;
+    }
+
+    if (ce->place == PlaceOnTop)
+        move_client(i, 0);
+    else
+        move_client(i, cvector_size(clients) - 1);
+    clip_changed = true;
+}
+
+
+
+void destroy_win(Window window, bool gone) {
+    unsigned long start = XNextRequest(display);
+    size_t i;
+    for (i = 0; i < cvector_size(clients); ++i) {
+        Client *w = &clients[i];
+        if (w->window == window) {
+            if (gone) {
+                finish_unmap_client(w);
+            }
+            // Clean up resources owned by the client
+            if (w->picture) {
+                XRenderFreePicture(display, w->picture);
+                w->picture = 0;
+            }
+            if (w->alpha_pict) {
+                XRenderFreePicture(display, w->alpha_pict);
+                w->alpha_pict = 0;
+            }
+            free_blur_cache(w);
+            free_client_surface(w);
+            free_client_texture(w);
+            free_frame_sync(w);
+            thumbnails_remove(w->window);
+            // The server destroys the Damage along with the window, and only
+            // a window that still exists has input selected to undo
+            if (w->cold->damage != 0 && !gone) {
+                XDamageDestroy(display, w->cold->damage);
+                w->cold->damage = 0;
+            }
+            if (w->cold->materialized && !gone)
+                XSelectInput(display, w->window, 0);
+            // More cleanup can be added here if needed
+
+            break;
+        }
+    }
+    if (i < cvector_size(clients)) {
+        unsigned long requests = clients[i].cold->requests + XNextRequest(display) - start;
+        stats.windows_destroyed++;
+        stats.window_requests += requests;
+        if (!clients[i].cold->materialized) {
+            stats.unmapped_destroyed++;
+            stats.unmapped_requests += requests;
+        }
+        if (clients[i].slot == layer_slot)
+            drop_layer();
+        grid_remove(&clients[i]);
+        cvector_push_back(free_slots, clients[i].slot);
+        if (clients[i].cold->shape_rects)
+            XFree(clients[i].cold->shape_rects);
+        free(clients[i].cold->class_name);
+        free(clients[i].cold->instance_name);
+        cvector_free(clients[i].cold->visible);
+        if (clients[i].cold->visible_region)
+            XFixesDestroyRegion(display, clients[i].cold->visible_region);
+        free(clients[i].cold);
+
+        // Remove the client from the vector
+        cvector_erase(clients, i);
+        slot_index_dirty = true;
+        clip_changed = true;
+    }
+}
+
+// A window and its position in the server's stacking order, topmost first
+typedef struct Stack_Entry {
+    Window window;
+    int position;
+} Stack_Entry;
+
+int compare_stack_entries(const void *a, const void *b) {
+    Window wa = ((const Stack_Entry *) a)->window;
+    Window wb = ((const Stack_Entry *) b)->window;
+    return (wa > wb) - (wa < wb);
+}
+
+Stack_Entry *find_stack_entry(Stack_Entry *entries, size_t count, Window window) {
+    Stack_Entry key;
+    key.window = window;
+    return bsearch(&key, entries, count, sizeof(Stack_Entry), compare_stack_entries);
+}
+
+// A client's index in `clients` and where the server says it belongs
+typedef struct Stack_Order {
+    int position;
+    int index;
+} Stack_Order;
+
+int compare_stack_orders(const void *a, const void *b) {
+    return ((const Stack_Order *) a)->position - ((const Stack_Order *) b)->position;
+}
+
+
+// Marks in `keep` one longest strictly increasing subsequence of `sequence`
+// (patience sorting, O(n log n)).
+void longest_increasing_subsequence(const int *sequence, int count, bool *keep) {
+    int *tails = malloc(sizeof(int) * (count + 1));     // index of the smallest tail of each length
+    int *previous = malloc(sizeof(int) * (count + 1));
+    int length = 0;
+
+    for (int i = 0; i < count; i++) {
+        int low = 0, high = length;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (sequence[tails[mid]] < sequence[i])
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        previous[i] = low > 0 ? tails[low - 1] : -1;
+        tails[low] = i;
+        if (low == length)
+            length++;
+    }
+
+    memset(keep, 0, sizeof(bool) * count);
+    for (int i = length ? tails[length - 1] : -1; i != -1; i = previous[i])
+        keep[i] = true;
+
+    free(tails);
+    free(previous);
+}
+
+
+// Rebuilds the stacking order from a single XQueryTree. Clients that are gone
+// are destroyed and unknown children are added; of the rest, the largest set
+// that is already in the right relative order stays put and only the clients
+// outside of it count as moved. Just those get their extents damaged.
+void resync_stacking() {
+    Window *children;
+    unsigned int children_count;
+    Window root_return, parent_return;
+
+    stacking_suspect = false;
+    if (!XQueryTree(display, root_window, &root_return, &parent_return, &children, &children_count))
+        return;
+
+    // XQueryTree lists the children bottom to top
+    Stack_Entry *tree = malloc(sizeof(Stack_Entry) * (children_count + 1));
+    for (unsigned int i = 0; i < children_count; i++) {
+        tree[i].window = children[i];
+        tree[i].position = children_count - 1 - i;
+    }
+    qsort(tree, children_count, sizeof(Stack_Entry), compare_stack_entries);
+
+    for (size_t i = cvector_size(clients); i-- > 0;) {
+        if (!find_stack_entry(tree, children_count, clients[i].window))
+            destroy_win(clients[i].window, true);
+    }
+
+    size_t known_count = cvector_size(clients);
+    Stack_Entry *known = malloc(sizeof(Stack_Entry) * (known_count + 1));
+    for (size_t i = 0; i < known_count; i++) {
+        known[i].window = clients[i].window;
+        known[i].position = 0;
+    }
+    qsort(known, known_count, sizeof(Stack_Entry), compare_stack_entries);
+    for (unsigned int i = 0; i < children_count; i++) {
+        if (!find_stack_entry(known, known_count, children[i]))
+            add_client(children[i]);
+    }
+    free(known);
+    XFree(children);
+
+    int count = cvector_size(clients);
+    int *sequence = malloc(sizeof(int) * (count + 1));
+    bool *keep = malloc(sizeof(bool) * (count + 1));
+    for (int i = 0; i < count; i++)
+        sequence[i] = find_stack_entry(tree, children_count, clients[i].window)->position;
+    longest_increasing_subsequence(sequence, count, keep);
+
+    int moved = 0;
+    for (int i = 0; i < count; i++) {
+        if (keep[i])
+            continue;
+        moved++;
+        if (clients[i].extents) {
+            XserverRegion damage = XFixesCreateRegion(display, NULL, 0);
+            XFixesCopyRegion(display, damage, clients[i].extents);
+            add_damage(damage);
+        }
+    }
+
+    if (moved) {
+        // Sort the clients into the server's order by their position
+        Stack_Order *order = malloc(sizeof(Stack_Order) * count);
+        Client *sorted = malloc(sizeof(Client) * count);
+        for (int i = 0; i < count; i++) {
+            order[i].position = sequence[i];
+            order[i].index = i;
+        }
+        qsort(order, count, sizeof(Stack_Order), compare_stack_orders);
+        for (int i = 0; i < count; i++)
+            sorted[i] = clients[order[i].index];
+        memcpy(clients, sorted, sizeof(Client) * count);
+        slot_index_dirty = true;
+        free(sorted);
+        free(order);
+        clip_changed = true;
+    }
+
+    free(sequence);
+    free(keep);
+    free(tree);
+}
+
+
+// Picks the report level for the client's damage from its last interval,
+// see DAMAGE_LEVEL_INTERVAL. A level has to be asked for twice in a row
+// before the Damage is created again with it, so a client that's busy for
+// a moment doesn't flip back and forth.
+// Returns whether the level changed, and with it the client's Damage
+bool adapt_damage_level(Client *client, uint64_t now) {
+    Client_Cold *cold = client->cold;
+    double seconds = (now - cold->level_since) / 1e9;
+    double rate = cold->level_updates / seconds;
+    double window_area = (double) (client->width + client->border_width * 2) *
+                         (client->height + client->border_width * 2);
+    double coverage = cold->level_updates && window_area > 0 ?
+                      cold->level_area / (cold->level_updates * window_area) : 0;
+
+    int level = XDamageReportNonEmpty;
+    if (rate >= BUSY_DAMAGE_RATE && coverage >= LARGE_DAMAGE)
+        level = XDamageReportBoundingBox;
+    else if (rate >= BUSY_DAMAGE_RATE && coverage <= SMALL_DAMAGE)
+        level = XDamageReportRawRectangles;
+
+    cold->level_updates = 0;
+    cold->level_area = 0;
+    cold->level_since = now;
+
+    if (level == cold->damage_level) {
+        cold->level_votes = 0;
+        return false;
+    }
+    if (++cold->level_votes < 2)
+        return false;
+
+    // Whatever the old Damage still held is lost, so repaint the whole window
+    cold->level_votes = 0;
+    cold->damage_level = level;
+    XDamageDestroy(display, cold->damage);
+    cold->damage = XDamageCreate(display, client->window, level);
+    if (client->extents) {
+        XserverRegion damage = XFixesCreateRegion(display, NULL, 0);
+        XFixesCopyRegion(display, damage, client->extents);
+        add_damage(damage);
+    } else {
+        add_damage(client_extents(client));
+    }
+    stats.damage_level_changes++;
+    return true;
+}
+
+
+// Damage on the parts of the client that are hidden is thrown away here,
+// the contents are still in the window's pixmap for when it's uncovered.
+// The notify's area is only the bounds of the damage, so that's what the
+// dropped pixels are counted from.
+void damage_client(XDamageNotifyEvent *de) {
+    Client *client = get_client_from_window(de->drawable);
+
+    if (!client) return;
+
+    // Left unsubtracted, a non-empty or bounding box Damage stays quiet
+    // until the screen comes back, the whole client is painted then
+    if (suspended) {
+        client->cold->slept_damage = true;
+        return;
+    }
+
+    if (clip_changed)
+        update_visibility();
+    Client_Cold *cold = client->cold;
+    // Hidden or not, the thumbnail is out of date
+    cold->thumbnail_dirty = true;
+
+    XRectangle area = de->area;
+    area.x += client->x + client->border_width;
+    area.y += client->y + client->border_width;
+    XRectangle whole = client_rect(client);
+    unsigned long total = clip_rectangle(&area, &whole) ? rectangle_area(&area) : 0;
+    if (debug_paint)
+        cold->debug_damage += total;
+
+    // Notifies still queued from before the level changed belong to a
+    // Damage that's gone, their area is all that's left of them
+    int level = de->damage == cold->damage ? cold->damage_level : XDamageReportRawRectangles;
+
+    // A raw update comes in as several notifies, the last without `more`
+    cold->level_area += total;
+    if (!de->more) {
+        cold->level_updates++;
+        cold->damage_events++;
+    }
+    if (cold->texture)
+        cold->texture_stale = true;
+    // The software backend's copy has to catch up even where it's hidden.
+    // A non-empty notify doesn't say where, so all of it is fetched then.
+    if (cold->surface) {
+        if (!client->damaged || level == XDamageReportNonEmpty)
+            dirty_surface(client, &whole);
+        else if (total)
+            dirty_surface(client, &area);
+    }
+
+    // A new level means a new Damage, and the one this notify came from
+    // mustn't be subtracted from any more. The whole client has been
+    // damaged instead, which covers this notify too.
+    uint64_t now = now_ns();
+    if (now - cold->level_since >= DAMAGE_LEVEL_INTERVAL && de->damage == cold->damage &&
+        adapt_damage_level(client, now)) {
+        if (cold->surface)
+            dirty_surface(client, &whole);
+        client->damaged = 1;
+        return;
+    }
+
+    if (client->occluded) {
+        if (level != XDamageReportRawRectangles)
+            XDamageSubtract(display, de->damage, 0, 0);
+        stats.damage_pixels_dropped += total;
+        client->damaged = 1;
+        return;
+    }
+    if (total)
+        dirty_blur_above(&area, client - clients);
+
+    XserverRegion parts;
+    if (!client->damaged) {
+        parts = client_extents(client);
+        if (level != XDamageReportRawRectangles)
+            XDamageSubtract(display, de->damage, 0, 0);
+    } else if (level == XDamageReportNonEmpty) {
+        parts = XFixesCreateRegion(display, NULL, 0);
+        XDamageSubtract(display, de->damage, 0, parts);
+        XFixesTranslateRegion(display, parts,
+                              client->x + client->border_width,
+                              client->y + client->border_width);
+    } else {
+        // The notify carries the damage itself. A bounding box only grows
+        // until it's subtracted, so that's done to hear about the next one.
+        if (level == XDamageReportBoundingBox)
+            XDamageSubtract(display, de->damage, 0, 0);
+        parts = XFixesCreateRegion(display, total ? &area : NULL, total ? 1 : 0);
+    }
+
+    if (!cold->fully_visible) {
+        if (!cold->visible_region)
+            cold->visible_region = XFixesCreateRegion(display, cold->visible, cvector_size(cold->visible));
+        XFixesIntersectRegion(display, parts, parts, cold->visible_region);
+
+        unsigned long shown = 0;
+        for (size_t i = 0; i < cvector_size(cold->visible); i++) {
+            XRectangle r = cold->visible[i];
+            if (clip_rectangle(&r, &area))
+                shown += rectangle_area(&r);
+        }
+        stats.damage_pixels_dropped += total - shown;
+    }
+    // Only damage below the active client changes the layer
+    if (client - clients > layer_index())
+        dirty_layer(parts);
+    // Half a frame isn't shown, it's painted once the client is done with it
+    if (cold->frame_drawing && cold->held_damage) {
+        XFixesUnionRegion(display, cold->held_damage, cold->held_damage, parts);
+        XFixesDestroyRegion(display, parts);
+    } else if (cold->frame_drawing) {
+        cold->held_damage = parts;
+    } else {
+        merge_damage(parts);
+    }
+    client->damaged = 1;
+}
 
-    restack_win(ce->window, ce->above);
 
-    if (damage) {
-        XserverRegion extents = client_extents(client);
-        XFixesUnionRegion(display, damage, damage, extents);
-        XFixesDestroyRegion(display, extents);
-        add_damage(damage);
+// The screen saver being on blanks the screen, unless it's an external one
+// drawing into its own window that still has to be shown. So does DPMS
+// turning the monitors off, which turns the screen saver on as well.
+bool screen_blanked(int saver_state, int saver_kind) {
+    if ((saver_state == ScreenSaverOn || saver_state == ScreenSaverCycle) && saver_kind != ScreenSaverExternal)
+        return true;
+    CARD16 level;
+    BOOL enabled;
+    return has_dpms && DPMSInfo(display, &level, &enabled) && enabled && level != DPMSModeOn;
+}
+
+
+void update_suspension(bool blanked) {
+    if (blanked == suspended)
+        return;
+    uint64_t now = now_ns();
+    suspended = blanked;
+    if (blanked) {
+        suspended_since = now;
+        stats.suspensions++;
+        return;
     }
-    client->shape_bounds.x += client->attr.x;
-    client->shape_bounds.y += client->attr.y;
-    if (!client->shaped) {
-        client->shape_bounds.width = client->attr.width;
-        client->shape_bounds.height = client->attr.height;
+    stats.suspended_ns += now - suspended_since;
+
+    // Rather than the damage that was skipped, every client that had any
+    // is painted whole
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        Client *client = &clients[i];
+        Client_Cold *cold = client->cold;
+        if (!cold->slept_damage)
+            continue;
+        cold->slept_damage = false;
+        if (cold->map_state != IsViewable)
+            continue;
+        if (cold->damage)
+            XDamageSubtract(display, cold->damage, 0, 0);
+        cold->thumbnail_dirty = true;
+        if (cold->texture)
+            cold->texture_stale = true;
+        XRectangle whole = client_rect(client);
+        if (cold->surface)
+            dirty_surface(client, &whole);
+        client->damaged = 1;
+        add_damage(client_extents(client));
     }
+}
 
-    clip_changed = true;
+
+void screensaver_notify(XScreenSaverNotifyEvent *se) {
+    update_suspension(screen_blanked(se->state, se->kind));
 }
 
 
-void circulate_client(XCirculateEvent *ce) {
-    Client *client = get_client_from_window(ce->window);
+void shape_win(XShapeEvent *se) {
+    Client *client = get_client_from_window(se->window);
 
     if (!client) return;
 
-    Window target_window;
-    if (ce->place == PlaceOnTop)
-        target_window = clients[0]->window;
-    else if (ce->place == PlaceOnBottom)
-        target_window = 0;
+    if (se->kind == ShapeBounding) {
+        XserverRegion region0;
+        XserverRegion region1;
+        clip_changed = true;
 
-    restack_win(client->window, target_window);
-    clip_changed = true;
+        region0 = XFixesCreateRegion(display, &client->cold->shape_bounds, 1);
+
+        if (se->shaped) {
+            client->cold->shaped = true;
+            client->cold->shape_stale = true;
+            client->cold->shape_bounds.x = client->x + se->x;
+            client->cold->shape_bounds.y = client->y + se->y;
+            client->cold->shape_bounds.width = se->width;
+            client->cold->shape_bounds.height = se->height;
+        } else {
+            client->cold->shaped = false;
+            client->cold->shape_bounds.x = client->x;
+            client->cold->shape_bounds.y = client->y;
+            client->cold->shape_bounds.width = client->width;
+            client->cold->shape_bounds.height = client->height;
+        }
+        invalidate_border_size(client);
+        update_corner_radius(client);
+
+        region1 = XFixesCreateRegion(display, &client->cold->shape_bounds, 1);
+        XFixesUnionRegion(display, region0, region0, region1);
+        XFixesDestroyRegion(display, region1);
+
+        /* repaint the old and new region with the next frame, like any other damage */
+        add_damage(region0);
+    }
 }
 
 
+// With the fullscreen unredirect policy, a solid window on top of the stack
+// that covers the whole screen is left for the server to draw directly, as
+// there is nothing for us to composite. Redirection is undone for the whole
+// root, so every named pixmap is stale once we redirect again.
+void update_unredirect() {
+    bool fullscreen = false;
+
+    if (config.unredirect == UNREDIRECT_FULLSCREEN) {
+        for (size_t i = 0; i < cvector_size(clients); ++i) {
+            Client *w = &clients[i];
+            if (w->cold->map_state != IsViewable || w->cold->class == InputOnly)
+                continue;
+            fullscreen = w->opaqueness == SOLID && !w->cold->shaped &&
+                         w->x <= 0 && w->y <= 0 &&
+                         w->x + w->width + w->border_width * 2 >= root_width &&
+                         w->y + w->height + w->border_width * 2 >= root_height;
+            break;
+        }
+    }
 
-void destroy_win(Window window, bool gone) {
-    size_t i;
-    for (i = 0; i < cvector_size(clients); ++i) {
-        Client *w = clients[i];
-        if (w->window == window) {
-            if (gone) {
-                finish_unmap_client(w);
-            }
-            // Clean up resources owned by the client
+    if (fullscreen == unredirected)
+        return;
+
+    if (fullscreen) {
+        XCompositeUnredirectSubwindows(display, root_window, CompositeRedirectManual);
+        // The overlay would still cover the window, take its shape away
+        if (overlay_window) {
+            XserverRegion empty = XFixesCreateRegion(display, NULL, 0);
+            XFixesSetWindowShapeRegion(display, overlay_window, ShapeBounding, 0, 0, empty);
+            XFixesDestroyRegion(display, empty);
+        }
+    } else {
+        XCompositeRedirectSubwindows(display, root_window, CompositeRedirectManual);
+        if (overlay_window)
+            XFixesSetWindowShapeRegion(display, overlay_window, ShapeBounding, 0, 0, None);
+        for (size_t i = 0; i < cvector_size(clients); ++i) {
+            Client *w = &clients[i];
             if (w->picture) {
                 XRenderFreePicture(display, w->picture);
                 w->picture = 0;
             }
-            if (w->alpha_pict) {
-                XRenderFreePicture(display, w->alpha_pict);
-                w->alpha_pict = 0;
-            }
-            if (w->damage != 0) {
-                XDamageDestroy(display, w->damage);
-                w->damage = 0;
+            if (w->cold->pixmap) {
+                XFreePixmap(display, w->cold->pixmap);
+                w->cold->pixmap = 0;
             }
-            // More cleanup can be added here if needed
-
-            break;
+            free_client_surface(w);
+            free_client_texture(w);
         }
+        damage_screen();
     }
-    if (i < cvector_size(clients)) {
-        // Perform any additional cleanup needed for the client before removing
-        // e.g., free(w->some_allocated_field);
-
-        // Remove the client from the vector
-        cvector_erase(clients, i);
-    }
+    unredirected = fullscreen;
 }
 
-void damage_client(XDamageNotifyEvent *de) {
-    Client *client = get_client_from_window(de->drawable);
 
-    if (!client) return;
+// Watch the directory rather than the file, editors tend to save by
+// writing a new file and renaming it over the old one
+void watch_config() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+        return;
 
-    XserverRegion parts;
-    if (!client->damaged) {
-        parts = client_extents(client);
-        XDamageSubtract(display, client->damage, 0, 0);
-    } else {
-        parts = XFixesCreateRegion(display, NULL, 0);
-        XDamageSubtract(display, client->damage, 0, parts);
-        XFixesTranslateRegion(display, parts,
-                              client->attr.x + client->attr.border_width,
-                              client->attr.y + client->attr.border_width);
+    char *copy = strdup(config_path);
+    if (inotify_add_watch(inotify_fd, dirname(copy),
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
     }
-    add_damage(parts);
-    client->damaged = 1;
+    free(copy);
 }
 
 
-void shape_win(XShapeEvent *se) {
-    Client *client = get_client_from_window(se->window);
+// Drains the inotify queue, returns true if any of it was about the config file
+bool config_file_changed() {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char *copy = strdup(config_path);
+    const char *name = basename(copy);
+    bool changed = false;
+    ssize_t length;
+
+    while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *) p;
+            if (event->len && !strcmp(event->name, name))
+                changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    free(copy);
+    return changed;
+}
 
-    if (!client) return;
 
-    if (se->kind == ShapeClip || se->kind == ShapeBounding) {
-        XserverRegion region0;
-        XserverRegion region1;
-        clip_changed = true;
+// Loads the config file again and applies whatever changed. Only the clients
+// whose opacity actually changes get re-evaluated damage.
+void reload_config() {
+    Config previous = config;
+    config_init(&config);
+    config_load(&config, config_path);
+    // The old table points into the old rules
+    compile_rules();
 
-        region0 = XFixesCreateRegion(display, &client->shape_bounds, 1);
+    if (memcmp(previous.background, config.background, sizeof(config.background)) && root_tile_filled) {
+        XRenderFreePicture(display, root_tile);
+        root_tile = 0;
+        damage_screen();
+    }
 
-        if (se->shaped) {
-            client->shaped = true;
-            client->shape_bounds.x = client->attr.x + se->x;
-            client->shape_bounds.y = client->attr.y + se->y;
-            client->shape_bounds.width = se->width;
-            client->shape_bounds.height = se->height;
-        } else {
-            client->shaped = false;
-            client->shape_bounds.x = client->attr.x;
-            client->shape_bounds.y = client->attr.y;
-            client->shape_bounds.width = client->attr.width;
-            client->shape_bounds.height = client->attr.height;
+    if (previous.window_opacity != config.window_opacity || previous.corner_radius != config.corner_radius ||
+        !config_rules_equal(&previous, &config)) {
+        for (size_t i = 0; i < cvector_size(clients); ++i) {
+            update_client_rule(&clients[i]);
+            if (clients[i].cold->map_state == IsViewable) {
+                update_client_opacity(&clients[i]);
+                update_client_blur(&clients[i]);
+                update_corner_radius(&clients[i]);
+            }
         }
+    }
 
-        region1 = XFixesCreateRegion(display, &client->shape_bounds, 1);
-        XFixesUnionRegion(display, region0, region0, region1);
-        XFixesDestroyRegion(display, region1);
+    if (previous.blur_passes != config.blur_passes && blurred_clients) {
+        dirty_blur_all();
+        damage_screen();
+    }
+
+    if (previous.debug_paint != config.debug_paint)
+        set_debug_paint(config.debug_paint);
+
+    if (previous.backend != config.backend)
+        fprintf(stderr, "The backend can only be changed by restarting\n");
+    config.backend = previous.backend;
+    // The swap interval is only set by glx_init, paint_gl paces frames by
+    // what it was set to
+    if (previous.vsync != config.vsync)
+        fprintf(stderr, "vsync can only be changed by restarting\n");
+    config.vsync = previous.vsync;
+    if (previous.thumbnail_size != config.thumbnail_size)
+        fprintf(stderr, "thumbnail_size can only be changed by restarting\n");
+    config.thumbnail_size = previous.thumbnail_size;
+
+    // The sockets in use stay, the new paths are freed with the previous
+    // config
+    char *path;
+    if ((previous.thumbnail_socket || config.thumbnail_socket) &&
+        (!previous.thumbnail_socket || !config.thumbnail_socket ||
+         strcmp(previous.thumbnail_socket, config.thumbnail_socket)))
+        fprintf(stderr, "thumbnail_socket can only be changed by restarting\n");
+    path = config.thumbnail_socket;
+    config.thumbnail_socket = previous.thumbnail_socket;
+    previous.thumbnail_socket = path;
+    if ((previous.export_socket || config.export_socket) &&
+        (!previous.export_socket || !config.export_socket || strcmp(previous.export_socket, config.export_socket)))
+        fprintf(stderr, "export_socket can only be changed by restarting\n");
+    path = config.export_socket;
+    config.export_socket = previous.export_socket;
+    previous.export_socket = path;
+
+    config_free(&previous);
+}
+
+
+// Only asks for the new value, the replies of a whole batch of events are
+// collected together before the next frame
+void property_notify(XPropertyEvent *pe) {
+    if (pe->window == root_window) {
+        if (pe->atom == net_supported_atom)
+            advertise_frame_sync();
+        else if (pe->atom == property_atoms[PROPERTY_ROOT_PIXMAP])
+            request_property(None, root_window, PROPERTY_ROOT_PIXMAP);
+        else if (pe->atom == property_atoms[PROPERTY_SETROOT_PIXMAP])
+            request_property(None, root_window, PROPERTY_SETROOT_PIXMAP);
+        return;
+    }
+
+    if (pe->atom == opacity_atom) {
+        Client *client = get_client_from_window(pe->window);
+        if (client && client->cold->map_state == IsViewable)
+            request_property(client->window, client->window, PROPERTY_OPACITY);
+        return;
+    }
 
-        /* ask for repaint of the old and new region */
-        paint_all(region0);
+    enum Cached_Property property;
+    if (pe->atom == property_atoms[PROPERTY_CLASS])
+        property = PROPERTY_CLASS;
+    else if (pe->atom == property_atoms[PROPERTY_STATE])
+        property = PROPERTY_STATE;
+    else if (pe->atom == property_atoms[PROPERTY_FRAME_COUNTER] && has_sync)
+        property = PROPERTY_FRAME_COUNTER;
+    else
+        return;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].cold->client_window == pe->window && clients[i].cold->map_state == IsViewable) {
+            request_property(clients[i].window, pe->window, property);
+            break;
+        }
     }
 }
 
 
+// Set while an error is expected, the code of the last one is kept in
+// trapped_error
+bool trap_errors;
+unsigned char trapped_error;
+
 int error_handler(Display *dpy, XErrorEvent *ev) {
     // You should do something here but we do nothing when an error happens
     //
     // abort();
+    if (trap_errors)
+        trapped_error = ev->error_code;
     return 0;
 }
 
@@ -680,7 +4275,9 @@ void expose_root(cvector(XRectangle *) rectangles) {
 
 // If you are making a windows manager with a compositor
 // and not just a compositor, then this isn't that relevant
-bool register_as_the_composite_manager() {
+// With `take_over` the selection is taken from whoever has it, which is the
+// process we were restarted from.
+bool register_as_the_composite_manager(bool take_over) {
     Window w;
     Atom a;
     char net_wm_cm[20];  // Ensure this is large enough for "_NET_WM_CM_Sxx" and the screen number.
@@ -689,7 +4286,7 @@ bool register_as_the_composite_manager() {
     a = XInternAtom(display, net_wm_cm, False);
 
     w = XGetSelectionOwner(display, a);
-    if (w != 0) {
+    if (w != 0 && !take_over) {
         XTextProperty tp;
         char **strs;
         int count;
@@ -724,12 +4321,616 @@ bool register_as_the_composite_manager() {
 
 
 
+//////////////////////////////////////////////////////////////////////////////////
+// Restart
+//
+// SIGHUP execs the compositor again in place, to pick up a new binary
+// without the startup of a new one: the clients, their stacking order and
+// their cached properties are written to a memfd the new process reads back,
+// and checked against the server in one round trip instead of being queried
+// one window at a time under a server grab.
+//
+// Redirection belongs to the X connection that asked for it, so the old
+// connection is kept open across the exec until the new one has taken the
+// overlay window. With the overlay (Present or GLX) the last frame stays up
+// while the redirection changes hands. The new process still paints its
+// first frame in full, it has no back buffers to paint just damage into.
+
+#define STATE_MAGIC 0x54534d43 // "CMST"
+#define STATE_VERSION 1
+
+// The first three fields stay where they are in every version, so a new
+// binary can always release the old connection
+typedef struct State_Header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t connection_fd;      // the old process's X connection
+    uint32_t client_count;
+    uint32_t quality_level;
+} State_Header;
+
+// One per client, topmost first, followed by the class and instance names
+typedef struct Saved_Client {
+    uint32_t window;
+    uint32_t client_window;
+    int16_t x, y;
+    uint16_t width, height, border_width;
+    uint8_t materialized;
+    uint8_t map_state;
+    uint8_t override_redirect;
+    uint8_t damage_level;
+    uint8_t shaped;
+    uint8_t fullscreen;
+    int16_t shape_x, shape_y;   // of the bounding shape, relative to the window
+    uint16_t shape_width, shape_height;
+    uint32_t property_opacity;
+    uint32_t counter_property;
+    int32_t class_name;         // offsets into the names, -1 if unset
+    int32_t instance_name;
+} Saved_Client;
+
+int saved_argc;
+char **saved_argv;
+
+
+int save_string(char *strings, size_t *used, const char *string) {
+    if (!string)
+        return -1;
+    int offset = *used;
+    strcpy(strings + offset, string);
+    *used += strlen(string) + 1;
+    return offset;
+}
+
+
+// Returns the memfd, or -1
+int save_state() {
+    size_t count = cvector_size(clients);
+    size_t names = 0;
+    for (size_t i = 0; i < count; ++i) {
+        Client_Cold *cold = clients[i].cold;
+        if (cold->class_name)
+            names += strlen(cold->class_name) + strlen(cold->instance_name) + 2;
+    }
+    size_t size = sizeof(State_Header) + count * sizeof(Saved_Client) + names;
+    int fd = shared_memory_create("compositor-state", size);
+    if (fd < 0)
+        return -1;
+    State_Header *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    header->magic = STATE_MAGIC;
+    header->version = STATE_VERSION;
+    header->connection_fd = ConnectionNumber(display);
+    header->client_count = count;
+    header->quality_level = quality_level;
+    Saved_Client *saved = (Saved_Client *) (header + 1);
+    char *strings = (char *) (saved + count);
+    size_t used = 0;
+    for (size_t i = 0; i < count; ++i) {
+        Client *client = &clients[i];
+        Client_Cold *cold = client->cold;
+        Saved_Client *s = &saved[i];
+        s->window = client->window;
+        s->client_window = cold->client_window;
+        s->x = client->x;
+        s->y = client->y;
+        s->width = client->width;
+        s->height = client->height;
+        s->border_width = client->border_width;
+        s->materialized = cold->materialized;
+        s->map_state = cold->map_state;
+        s->override_redirect = cold->override_redirect;
+        s->damage_level = cold->damage_level;
+        s->shaped = cold->shaped;
+        s->fullscreen = cold->fullscreen;
+        s->shape_x = cold->shape_bounds.x - client->x;
+        s->shape_y = cold->shape_bounds.y - client->y;
+        s->shape_width = cold->shape_bounds.width;
+        s->shape_height = cold->shape_bounds.height;
+        s->property_opacity = cold->property_opacity;
+        s->counter_property = cold->counter_property;
+        s->class_name = save_string(strings, &used, cold->class_name);
+        s->instance_name = save_string(strings, &used, cold->instance_name);
+    }
+    munmap(header, size);
+    return fd;
+}
+
+
+void restart() {
+    int fd = save_state();
+    if (fd < 0) {
+        fprintf(stderr, "Can't save the state to restart with\n");
+        return;
+    }
+    XSync(display, False);
+
+    // Both have to survive the exec
+    int connection_fd = ConnectionNumber(display);
+    fcntl(fd, F_SETFD, 0);
+    fcntl(connection_fd, F_SETFD, 0);
+
+    char **args = malloc(sizeof(char *) * (saved_argc + 2));
+    int count = 0;
+    for (int i = 0; i < saved_argc; i++) {
+        if (strncmp(saved_argv[i], "--resume-fd", 11))
+            args[count++] = saved_argv[i];
+    }
+    char resume[32];
+    snprintf(resume, sizeof(resume), "--resume-fd=%d", fd);
+    args[count++] = resume;
+    args[count] = NULL;
+
+    // By name first, so an upgraded binary is the one that's run
+    execvp(args[0], args);
+    execv("/proc/self/exe", args);
+
+    perror("Can't restart");
+    free(args);
+    close(fd);
+    fcntl(connection_fd, F_SETFD, FD_CLOEXEC);
+}
+
+
+// Maps the state written by save_state, NULL if there's nothing usable
+const State_Header *load_state(int fd, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(State_Header)) {
+        close(fd);
+        return NULL;
+    }
+    const State_Header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+        return NULL;
+    *size = st.st_size;
+    if (header->magic != STATE_MAGIC) {
+        munmap((void *) header, st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+
+// Closes the old process's connection and redirects the windows once the
+// server has let go of its redirection. The overlay window must already
+// be ours, or the windows show unredirected meanwhile.
+void take_over_redirection(int old_connection) {
+    close(old_connection);
+    trap_errors = true;
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        trapped_error = 0;
+        XCompositeRedirectSubwindows(display, root_window, CompositeRedirectManual);
+        XSync(display, False);
+        if (!trapped_error)
+            break;
+        // BadAccess until the server has noticed the connection is gone
+        struct timespec wait = { 0, 1000000 };
+        nanosleep(&wait, NULL);
+    }
+    trap_errors = false;
+    if (trapped_error)
+        fprintf(stderr, "Can't take over the redirection of the windows\n");
+}
+
+
+Visual *find_visual(VisualID id) {
+    XVisualInfo template;
+    template.visualid = id;
+    int count;
+    XVisualInfo *info = XGetVisualInfo(display, VisualIDMask, &template, &count);
+    Visual *visual = count > 0 ? info->visual : NULL;
+    if (info)
+        XFree(info);
+    return visual;
+}
+
+
+// Tracks the saved clients again. Their attributes and geometry are asked
+// for all at once, and a window that changed while we restarted is added
+// like an unknown one. Windows created or destroyed meanwhile are found by
+// resync_stacking. Returns false if the state is of another version.
+bool resume_clients(const State_Header *header, size_t size) {
+    if (header->version != STATE_VERSION ||
+        size < sizeof(State_Header) + header->client_count * sizeof(Saved_Client))
+        return false;
+
+    size_t count = header->client_count;
+    const Saved_Client *saved = (const Saved_Client *) (header + 1);
+    const char *strings = (const char *) (saved + count);
+    size_t strings_size = size - sizeof(State_Header) - count * sizeof(Saved_Client);
+    quality_level = header->quality_level <= QUALITY_HALF_RATE ? header->quality_level : QUALITY_FULL;
+
+    xcb_get_window_attributes_cookie_t *attributes = malloc(sizeof(*attributes) * (count + 1));
+    xcb_get_geometry_cookie_t *geometries = malloc(sizeof(*geometries) * (count + 1));
+    for (size_t i = 0; i < count; i++) {
+        attributes[i] = xcb_get_window_attributes(connection, saved[i].window);
+        geometries[i] = xcb_get_geometry(connection, saved[i].window);
+    }
+
+    // Bottom first, every client is put on top of the ones before it
+    for (size_t i = count; i-- > 0;) {
+        const Saved_Client *s = &saved[i];
+        xcb_get_window_attributes_reply_t *attr = xcb_get_window_attributes_reply(connection, attributes[i], NULL);
+        xcb_get_geometry_reply_t *geometry = xcb_get_geometry_reply(connection, geometries[i], NULL);
+        if (!attr || !geometry) {
+            // Gone already
+        } else if (attr->map_state != s->map_state || attr->override_redirect != s->override_redirect ||
+                   geometry->x != s->x || geometry->y != s->y || geometry->width != s->width ||
+                   geometry->height != s->height || geometry->border_width != s->border_width) {
+            add_client(s->window);
+        } else {
+            Client *client = track_client(s->window, s->x, s->y, s->width, s->height, s->border_width,
+                                          s->override_redirect);
+            if (client && s->materialized) {
+                Client_Cold *cold = client->cold;
+                XWindowAttributes restored;
+                restored.visual = find_visual(attr->visual);
+                restored.depth = geometry->depth;
+                restored.class = attr->_class;
+                restored.override_redirect = attr->override_redirect;
+                cold->damage_level = s->damage_level;
+                apply_attributes(client, &restored);
+
+                cold->client_window = s->client_window;
+                if (s->class_name >= 0 && s->instance_name >= 0 &&
+                    (size_t) s->class_name < strings_size && (size_t) s->instance_name < strings_size) {
+                    cold->class_name = strndup(strings + s->class_name, strings_size - s->class_name);
+                    cold->instance_name = strndup(strings + s->instance_name, strings_size - s->instance_name);
+                }
+                cold->property_opacity = s->property_opacity;
+                cold->counter_property = s->counter_property;
+                cold->fullscreen = s->fullscreen;
+                cold->shaped = s->shaped;
+                cold->shape_stale = s->shaped;
+                if (s->shaped) {
+                    cold->shape_bounds.x = s->x + s->shape_x;
+                    cold->shape_bounds.y = s->y + s->shape_y;
+                    cold->shape_bounds.width = s->shape_width;
+                    cold->shape_bounds.height = s->shape_height;
+                }
+
+                if (s->map_state == IsViewable) {
+                    cold->map_state = IsViewable;
+                    grid_update(client);
+                    clip_changed = true;
+                    watch_client_properties(client);
+                    invalidate_border_size(client);
+                    show_client(client);
+                }
+            }
+        }
+        free(attr);
+        free(geometry);
+    }
+    free(attributes);
+    free(geometries);
+
+    stacking_suspect = true;
+    return true;
+}
+
+
+void handle_event(XEvent *ev) {
+    switch (ev->type) {
+        case CreateNotify:
+            create_client(&ev->xcreatewindow);
+            break;
+        case ConfigureNotify:
+            configure_client(&ev->xconfigure);
+            break;
+        case DestroyNotify:
+            destroy_win(ev->xdestroywindow.window, 1);
+            break;
+        case MapNotify:
+            map_win(ev->xmap.window);
+            break;
+        case UnmapNotify:
+            unmap_win(ev->xunmap.window);
+            break;
+        case ReparentNotify:
+            if (ev->xreparent.parent == root_window) {
+                add_client(ev->xreparent.window);
+            } else {
+                destroy_win(ev->xreparent.window, 0);
+            }
+            break;
+        case CirculateNotify:
+            circulate_client(&ev->xcirculate);
+            break;
+        case Expose:
+            if (overlay_window && ev->xexpose.window == overlay_window) {
+                XRectangle r = { ev->xexpose.x, ev->xexpose.y, ev->xexpose.width, ev->xexpose.height };
+                add_damage(XFixesCreateRegion(display, &r, 1));
+            }
+            break;
+        case PropertyNotify:
+            property_notify(&ev->xproperty);
+            break;
+        default:
+            if (ev->type == GenericEvent && use_present && ev->xgeneric.extension == present_opcode) {
+                // The ingest thread has already copied the event data in
+                if (ev->xgeneric.evtype == PresentCompleteNotify)
+                    present_complete((XPresentCompleteNotifyEvent *) ev);
+                else if (ev->xgeneric.evtype == PresentIdleNotify)
+                    present_idle((XPresentIdleNotifyEvent *) ev);
+            } else if (ev->type == damage_event + XDamageNotify) {
+                damage_client((XDamageNotifyEvent *) ev);
+            } else if (ev->type == xshape_event + ShapeNotify) {
+                shape_win((XShapeEvent *) ev);
+            } else if (has_sync && ev->type == sync_event + XSyncAlarmNotify) {
+                frame_counter_changed((XSyncAlarmNotifyEvent *) ev);
+            } else if (has_screensaver && ev->type == screensaver_event + ScreenSaverNotify) {
+                screensaver_notify((XScreenSaverNotifyEvent *) ev);
+            } else if (has_xrandr && (ev->type == xrandr_event + RRScreenChangeNotify ||
+                                      ev->type == xrandr_event + RRNotify)) {
+                // A monitor was plugged, unplugged or changed mode
+                XRRUpdateConfiguration(ev);
+                update_outputs();
+                damage_screen();
+            }
+            break;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Event ingestion
+
+
+// The window an event is about. For the structure events we get through
+// SubstructureNotify on the root, xany.window is the root itself.
+Window event_subject(XEvent *ev) {
+    switch (ev->type) {
+        case CreateNotify:
+            return ev->xcreatewindow.window;
+        case ConfigureNotify:
+            return ev->xconfigure.window;
+        case DestroyNotify:
+            return ev->xdestroywindow.window;
+        case MapNotify:
+            return ev->xmap.window;
+        case UnmapNotify:
+            return ev->xunmap.window;
+        case ReparentNotify:
+            return ev->xreparent.window;
+        case CirculateNotify:
+            return ev->xcirculate.window;
+        default:
+            return ev->xany.window; // the drawable of a DamageNotify
+    }
+}
+
+
+// Folds `ev` into the batch if the render thread would only undo it again.
+// Damage for a window is merged into its earlier notify, as long as nothing
+// happened to the window in between (a damage after a remap must not be
+// moved before it) and the merged bounds aren't much bigger than the two
+// areas, which would throw away the precision of raw rectangles.
+// Back-to-back ConfigureNotifys for one window collapse into the last one;
+// non-adjacent ones can't, other restacks may refer to the intermediate
+// position.
+bool coalesce_event(XEvent *batch, int count, XEvent *ev) {
+    if (ev->type == damage_event + XDamageNotify) {
+        XDamageNotifyEvent *de = (XDamageNotifyEvent *) ev;
+        for (int i = count - 1; i >= 0; i--) {
+            if (batch[i].type == damage_event + XDamageNotify) {
+                XDamageNotifyEvent *earlier = (XDamageNotifyEvent *) &batch[i];
+                if (earlier->damage != de->damage)
+                    continue;
+                int x0 = de->area.x < earlier->area.x ? de->area.x : earlier->area.x;
+                int y0 = de->area.y < earlier->area.y ? de->area.y : earlier->area.y;
+                int x1 = earlier->area.x + earlier->area.width;
+                int y1 = earlier->area.y + earlier->area.height;
+                if (de->area.x + de->area.width > x1)
+                    x1 = de->area.x + de->area.width;
+                if (de->area.y + de->area.height > y1)
+                    y1 = de->area.y + de->area.height;
+                if ((long) (x1 - x0) * (y1 - y0) >
+                    (long) earlier->area.width * earlier->area.height +
+                    (long) de->area.width * de->area.height)
+                    return false;
+                earlier->area.x = x0;
+                earlier->area.y = y0;
+                earlier->area.width = x1 - x0;
+                earlier->area.height = y1 - y0;
+                earlier->more = de->more;
+                earlier->geometry = de->geometry;
+                return true;
+            }
+            if (event_subject(&batch[i]) == de->drawable)
+                return false;
+        }
+        return false;
+    }
+
+    if (ev->type == ConfigureNotify && count > 0 && batch[count - 1].type == ConfigureNotify &&
+        batch[count - 1].xconfigure.window == ev->xconfigure.window) {
+        batch[count - 1] = *ev;
+        return true;
+    }
+    return false;
+}
+
+
+// XNextEvent, with the data of a Present event copied into the event itself.
+// The data lives in Xlib only until the next event is read, so the render
+// thread couldn't fetch it later.
+void next_event(XEvent *ev) {
+    XNextEvent(display, ev);
+    if (ev->type != GenericEvent || !use_present || ev->xcookie.extension != present_opcode)
+        return;
+    if (!XGetEventData(display, &ev->xcookie))
+        return;
+    XGenericEventCookie cookie = ev->xcookie;
+    size_t size = 0;
+    if (cookie.evtype == PresentCompleteNotify)
+        size = sizeof(XPresentCompleteNotifyEvent);
+    else if (cookie.evtype == PresentIdleNotify)
+        size = sizeof(XPresentIdleNotifyEvent);
+    if (size && size <= sizeof(XEvent))
+        memcpy(ev, cookie.data, size);
+    XFreeEventData(display, &cookie);
+}
+
+
+// The ingest thread. It blocks in XNextEvent, then takes whatever else has
+// already arrived, coalesces it and pushes it to the render thread. Xlib
+// drops the display lock while waiting, so the render thread can keep
+// making requests meanwhile.
+void *ingest_events(void *arg) {
+    static XEvent batch[INGEST_BATCH];
+
+    while (1) {
+        int count = 0;
+        next_event(&batch[count++]);
+        // Counted as they come off the wire, a merged notify was still sent
+        unsigned long damage_notifies = batch[0].type == damage_event + XDamageNotify;
+        while (count < INGEST_BATCH && XEventsQueued(display, QueuedAfterReading)) {
+            XEvent ev;
+            next_event(&ev);
+            damage_notifies += ev.type == damage_event + XDamageNotify;
+            if (coalesce_event(batch, count, &ev))
+                atomic_fetch_add_explicit(&stats.events_coalesced, 1, memory_order_relaxed);
+            else
+                batch[count++] = ev;
+        }
+        atomic_fetch_add_explicit(&stats.events_ingested, count, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stats.damage_bytes, damage_notifies * DAMAGE_NOTIFY_SIZE, memory_order_relaxed);
+
+        uint64_t one = 1;
+        for (int i = 0; i < count; i++) {
+            if (event_queue_push(&event_queue, &batch[i]))
+                continue;
+            // The render thread is behind, make sure it's awake and wait for room
+            atomic_fetch_add_explicit(&event_queue.stalls, 1, memory_order_relaxed);
+            write(wake_fd, &one, sizeof(one));
+            while (!event_queue_push(&event_queue, &batch[i])) {
+                struct timespec wait = { 0, 100000 };
+                nanosleep(&wait, NULL);
+            }
+        }
+        write(wake_fd, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+
+void dump_stats() {
+    fprintf(stderr, "events: %lu ingested, %lu coalesced\n",
+            atomic_load(&stats.events_ingested), atomic_load(&stats.events_coalesced));
+    fprintf(stderr, "event queue: depth %zu, high water %zu of %zu, %lu producer stalls\n",
+            event_queue_depth(&event_queue), atomic_load(&event_queue.high_water),
+            event_queue.capacity, atomic_load(&event_queue.stalls));
+    fprintf(stderr, "damage: %lu pixels dropped on hidden windows\n", stats.damage_pixels_dropped);
+    int levels[4] = { 0 };
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].cold->damage)
+            levels[clients[i].cold->damage_level]++;
+    }
+    fprintf(stderr, "damage levels: %d raw rectangles, %d bounding box, %d non-empty, %lu changes, %lu bytes of notifies\n",
+            levels[XDamageReportRawRectangles], levels[XDamageReportBoundingBox],
+            levels[XDamageReportNonEmpty], stats.damage_level_changes, atomic_load(&stats.damage_bytes));
+    fprintf(stderr, "windows: %lu destroyed at %.1f requests each, %lu never mapped at %.1f each\n",
+            stats.windows_destroyed,
+            stats.windows_destroyed ? (double) stats.window_requests / stats.windows_destroyed : 0.0,
+            stats.unmapped_destroyed,
+            stats.unmapped_destroyed ? (double) stats.unmapped_requests / stats.unmapped_destroyed : 0.0);
+    if (use_present)
+        fprintf(stderr, "present: %lu frames, %lu missed vblanks\n",
+                stats.frames_presented, stats.missed_vblanks);
+    uint64_t now = now_ns();
+    double seconds = (now - wakeups_since) / 1e9;
+    fprintf(stderr, "idle: %lu wakeups, %.2f a second since the last dump, %s, %.1fs suspended in %lu blanks\n",
+            stats.wakeups, seconds > 0 ? (stats.wakeups - wakeups_before) / seconds : 0.0,
+            suspended ? "suspended" : "painting",
+            (stats.suspended_ns + (suspended ? now - suspended_since : 0)) / 1e9, stats.suspensions);
+    wakeups_since = now;
+    wakeups_before = stats.wakeups;
+    fprintf(stderr, "properties: %lu fetched in %lu round trips, %zu rules\n",
+            stats.property_fetches, stats.property_round_trips, cvector_size(config.rules));
+    if (has_sync)
+        fprintf(stderr, "frame sync: %d clients, %lu frames reported drawn, %lu held until finished\n",
+                frame_sync_clients, stats.frames_drawn_sent, stats.frames_held);
+    if (config.backend == BACKEND_SOFTWARE)
+        sw_dump_stats();
+    if (config.backend == BACKEND_GLX)
+        glx_dump_stats();
+    if (config.adaptive_quality) {
+        uint64_t spent[4];
+        memcpy(spent, quality_level_ns, sizeof(spent));
+        spent[quality_level] += now_ns() - quality_level_since;
+        fprintf(stderr, "quality: %s, %lu of %lu frames over budget, %lu steps down, %lu up, "
+                "%.1fs/%.1fs/%.1fs/%.1fs at each level\n",
+                quality_names[quality_level], stats.frames_over_budget, stats.frames_timed,
+                stats.quality_downgrades, stats.quality_upgrades,
+                spent[0] / 1e9, spent[1] / 1e9, spent[2] / 1e9, spent[3] / 1e9);
+    }
+    int largest = -1;
+    for (size_t i = 0; i < cvector_size(clients); ++i) {
+        if (clients[i].cold->memory && (largest < 0 || clients[i].cold->memory > clients[largest].cold->memory))
+            largest = i;
+    }
+    fprintf(stderr, "memory: %.1f MiB held for windows (budget %d MiB), most by 0x%lx with %.1f MiB, "
+            "%.1f MiB of named window pixmaps, %lu evictions freed %.1f MiB\n",
+            memory_held / 1048576.0, config.memory_budget,
+            largest >= 0 ? clients[largest].window : 0, largest >= 0 ? clients[largest].cold->memory / 1048576.0 : 0.0,
+            memory_named / 1048576.0, stats.evictions, stats.evicted_bytes / 1048576.0);
+    frame_export_dump_stats();
+    thumbnails_dump_stats();
+    fprintf(stderr, "layer: active window 0x%lx, %lu frames on the layer, %lu of them composited part of it again\n",
+            layer_slot >= 0 ? clients[layer_index()].window : 0, stats.layer_frames, stats.layer_rebuilds);
+}
+
+
+void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-c config-file]\n", program);
+}
+
+
 int main(int argc, char **argv) {
+    saved_argc = argc;
+    saved_argv = argv;
+    // Only passed by restart
+    static const struct option long_options[] = {
+        { "resume-fd", required_argument, NULL, 'r' },
+        { NULL, 0, NULL, 0 },
+    };
+    int resume_fd = -1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                config_path = strdup(optarg);
+                break;
+            case 'r':
+                resume_fd = atoi(optarg);
+                break;
+            case 'h':
+                usage(argv[0]);
+                exit(0);
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (!config_path)
+        config_path = config_default_path();
+    config_init(&config);
+    config_load(&config, config_path);
+
+    // The display is shared between the ingest and the render thread
+    XInitThreads();
     display = XOpenDisplay(NULL);
     if (!display) {
         fprintf(stderr, "Can't open display\n");
         exit(1);
     }
+    connection = XGetXCBConnection(display);
 
     XSetErrorHandler(error_handler);
     XSynchronize(display, 1);
@@ -771,11 +4972,42 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (!register_as_the_composite_manager()) {
+    // RandR is optional, without it the whole screen is painted as one output
+    has_xrandr = XRRQueryExtension(display, &xrandr_event, &xrandr_error);
+
+    // So is Sync, without it clients just aren't told when their frames are drawn
+    int sync_major, sync_minor;
+    has_sync = XSyncQueryExtension(display, &sync_event, &sync_error) &&
+        XSyncInitialize(display, &sync_major, &sync_minor);
+
+    // And the screen saver and DPMS, without them we just keep painting
+    // while the screen is blank
+    has_screensaver = XScreenSaverQueryExtension(display, &screensaver_event, &screensaver_error);
+    int dpms_event, dpms_error;
+    has_dpms = DPMSQueryExtension(display, &dpms_event, &dpms_error) && DPMSCapable(display);
+
+    size_t state_size = 0;
+    const State_Header *state = resume_fd >= 0 ? load_state(resume_fd, &state_size) : NULL;
+    if (!register_as_the_composite_manager(state != NULL)) {
         exit(1);
     }
 
     opacity_atom = XInternAtom(display, "_NET_WM_WINDOW_OPACITY", False);
+    wm_state_atom = XInternAtom(display, "WM_STATE", False);
+    fullscreen_atom = XInternAtom(display, "_NET_WM_STATE_FULLSCREEN", False);
+    sync_counter_atom = XInternAtom(display, "_NET_WM_SYNC_REQUEST_COUNTER", False);
+    frame_drawn_atom = XInternAtom(display, "_NET_WM_FRAME_DRAWN", False);
+    frame_timings_atom = XInternAtom(display, "_NET_WM_FRAME_TIMINGS", False);
+    net_supported_atom = XInternAtom(display, "_NET_SUPPORTED", False);
+    property_atoms[PROPERTY_CLASS] = XA_WM_CLASS;
+    property_atoms[PROPERTY_OPACITY] = opacity_atom;
+    property_atoms[PROPERTY_FRAME_COUNTER] = sync_counter_atom;
+    property_atoms[PROPERTY_STATE] = XInternAtom(display, "_NET_WM_STATE", False);
+    property_atoms[PROPERTY_ROOT_PIXMAP] = XInternAtom(display, "_XROOTPMAP_ID", False);
+    property_atoms[PROPERTY_SETROOT_PIXMAP] = XInternAtom(display, "_XSETROOT_ID", False);
+    compile_rules();
+    request_root_properties();
+    collect_properties();
 
     XRenderPictureAttributes pa;
     pa.subwindow_mode = IncludeInferiors;
@@ -785,77 +5017,190 @@ int main(int argc, char **argv) {
     all_damage = 0;
     clip_changed = true;
 
-    XCompositeRedirectSubwindows(display, root_window, CompositeRedirectManual);
+    // The OpenGL backend syncs with its swap interval instead
+    if (config.vsync && config.backend != BACKEND_GLX) {
+        int present_event, present_error;
+        use_present = XPresentQueryExtension(display, &present_opcode, &present_event, &present_error);
+        if (!use_present)
+            fprintf(stderr, "No Present extension, frames are not synced to vblank\n");
+    }
+    if (use_present || config.backend == BACKEND_GLX) {
+        // The overlay is above every window, it mustn't take their input
+        overlay_window = XCompositeGetOverlayWindow(display, root_window);
+        XserverRegion empty = XFixesCreateRegion(display, NULL, 0);
+        XFixesSetWindowShapeRegion(display, overlay_window, ShapeInput, 0, 0, empty);
+        XFixesDestroyRegion(display, empty);
+        XSelectInput(display, overlay_window, ExposureMask);
+    }
+    if (use_present)
+        XPresentSelectInput(display, overlay_window, PresentCompleteNotifyMask | PresentIdleNotifyMask);
+    if (config.backend == BACKEND_GLX &&
+        !glx_init(display, overlay_window, root_width, root_height, config.vsync)) {
+        fprintf(stderr, "Falling back to the xrender backend\n");
+        config.backend = BACKEND_XRENDER;
+        XCompositeReleaseOverlayWindow(display, root_window);
+        overlay_window = 0;
+    }
+
+    if (state)
+        take_over_redirection(state->connection_fd);
+    else
+        XCompositeRedirectSubwindows(display, root_window, CompositeRedirectManual);
     XSelectInput(display, root_window, SubstructureNotifyMask | ExposureMask | StructureNotifyMask | PropertyChangeMask);
     XShapeSelectInput(display, root_window, ShapeNotifyMask);
-
-    XGrabServer(display);
-    Window *children;
-    unsigned int children_count;
-    Window root_return, parent_return;
-    XQueryTree(display, root_window, &root_return, &parent_return, &children, &children_count);
-    for (int i = 0; i < children_count; i++) {
-        add_client(children[i]);
+    if (has_xrandr)
+        XRRSelectInput(display, root_window, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+    advertise_frame_sync();
+    if (has_screensaver) {
+        XScreenSaverSelectInput(display, root_window, ScreenSaverNotifyMask);
+        XScreenSaverInfo *info = XScreenSaverAllocInfo();
+        if (info && XScreenSaverQueryInfo(display, root_window, info))
+            update_suspension(screen_blanked(info->state, info->kind));
+        if (info)
+            XFree(info);
+    }
+    update_outputs();
+    grid_rebuild();
+
+    if (!state || !resume_clients(state, state_size)) {
+        XGrabServer(display);
+        Window *children;
+        unsigned int children_count;
+        Window root_return, parent_return;
+        XQueryTree(display, root_window, &root_return, &parent_return, &children, &children_count);
+        for (int i = 0; i < children_count; i++) {
+            add_client(children[i]);
+        }
+        XFree(children);
+        XUngrabServer(display);
+    }
+    if (state)
+        munmap((void *) state, state_size);
+
+    // The first frame is painted by the loop like any other
+    damage_screen();
+    set_debug_paint(config.debug_paint);
+
+    watch_config();
+
+    // SIGUSR1 dumps the stats, SIGUSR2 switches the paint debugging view and
+    // SIGHUP restarts. They're blocked before the ingest thread exists so
+    // that only the render thread sees them, through signal_fd.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0 || !event_queue_init(&event_queue, EVENT_QUEUE_SIZE)) {
+        fprintf(stderr, "Can't set up the event queue\n");
+        exit(1);
+    }
+    pthread_t ingest_thread;
+    if (pthread_create(&ingest_thread, NULL, ingest_events, NULL)) {
+        fprintf(stderr, "Can't start the ingest thread\n");
+        exit(1);
     }
-    XFree(children);
-    XUngrabServer(display);
 
-    // Note: The handling of root_expose_rects needs to be adapted from C++ std::vector to a C equivalent.
-    // Assuming you have defined a suitable data structure or array for root_expose_rects
+    if (config.backend == BACKEND_SOFTWARE) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        sw_init(display, cores > 0 ? cores : 1);
+    }
 
-    paint_all(0);
+    // The OpenGL backend draws straight into the overlay, there's no
+    // root_buffer to publish from
+    if (config.export_socket && config.backend == BACKEND_GLX)
+        fprintf(stderr, "The frame export doesn't work with the glx backend, export_socket is ignored\n");
+    else if (config.export_socket)
+        frame_export_init(display, config.export_socket);
+    if (config.thumbnail_socket)
+        thumbnails_init(display, config.thumbnail_socket, config.thumbnail_size);
+
+    struct pollfd ufd[5];
+    ufd[0].fd = wake_fd;
+    ufd[0].events = POLLIN;
+    ufd[1].fd = inotify_fd; // ignored by poll when negative
+    ufd[1].events = POLLIN;
+    ufd[2].fd = signal_fd;
+    ufd[2].events = POLLIN;
+    ufd[3].fd = frame_export_listen_fd();
+    ufd[3].events = POLLIN;
+    ufd[4].fd = thumbnails_listen_fd();
+    ufd[4].events = POLLIN;
+
+    quality_level_since = wakeups_since = now_ns();
 
     XEvent ev;
     while (1) {
-        do {
-            XNextEvent(display, &ev);
-            switch (ev.type) {
-                case CreateNotify:
-                    add_client(ev.xcreatewindow.window);
-                    break;
-                case ConfigureNotify:
-                    configure_client(&ev.xconfigure);
-                    break;
-                case DestroyNotify:
-                    destroy_win(ev.xdestroywindow.window, 1);
-                    break;
-                case MapNotify:
-                    map_win(ev.xmap.window);
-                    break;
-                case UnmapNotify:
-                    unmap_win(ev.xunmap.window);
-                    break;
-                case ReparentNotify:
-                    if (ev.xreparent.parent == root_window) {
-                        add_client(ev.xreparent.window);
-                    } else {
-                        destroy_win(ev.xreparent.window, 0);
-                    }
-                    break;
-                case CirculateNotify:
-                    circulate_client(&ev.xcirculate);
-                    break;
-                case Expose:
-                    // Adapt the handling of expose events for root_expose_rects
-                    break;
-                case PropertyNotify:
-                    // Handle property notifications
-                    break;
-                default:
-                    if (ev.type == damage_event + XDamageNotify) {
-                        damage_client((XDamageNotifyEvent *) &ev);
-                    } else if (ev.type == xshape_event + ShapeNotify) {
-                        shape_win((XShapeEvent *) &ev);
-                    }
-                    break;
-            }
-        } while (XQLength(display));
+        while (event_queue_pop(&event_queue, &ev))
+            handle_event(&ev);
+        collect_properties();
+        apply_property_changes();
 
-        if (all_damage != 0) {
-            paint_all(all_damage);
-            XSync(display, False);
+        if (inotify_fd >= 0 && config_file_changed())
+            reload_config();
+
+        if (stacking_suspect)
+            resync_stacking();
+
+        if (clip_changed)
+            update_visibility();
+
+        update_unredirect();
+        if (unredirected && all_damage) {
+            // Nothing of ours is visible, so there is nothing to repaint
+            XFixesDestroyRegion(display, all_damage);
             all_damage = 0;
-            clip_changed = false;
+        }
+
+        // Sleeps until either more events arrive or the next output with
+        // damage on it is due for a frame. Nothing here runs on a timer
+        // of its own, with no damage and nothing waiting for a vblank or a
+        // thumbnail the timeout is -1 and only an event wakes us up.
+        int timeout = -1;
+        if (!suspended) {
+            timeout = paint_due_outputs();
+            govern_quality();
+            enforce_memory_budget();
+            // Clients drawing frames nobody can see wait for the screen to
+            // come back too
+            if (!all_damage)
+                report_frames_drawn();
+            int thumbnail_timeout = update_thumbnails();
+            if (thumbnail_timeout >= 0 && (timeout < 0 || thumbnail_timeout < timeout))
+                timeout = thumbnail_timeout;
+        }
+        if (event_queue_depth(&event_queue))
+            continue;
+        poll(ufd, 5, timeout);
+        stats.wakeups++;
+
+        uint64_t wakeups;
+        read(wake_fd, &wakeups, sizeof(wakeups));
+
+        struct signalfd_siginfo info;
+        if (signal_fd >= 0 && read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            if (info.ssi_signo == SIGHUP)
+                restart();
+            else if (info.ssi_signo == SIGUSR2)
+                set_debug_paint((debug_paint + 1) % (DEBUG_PAINT_OVERDRAW + 1));
+            else
+                dump_stats();
+        }
+
+        // A new consumer of the frame export needs a whole frame to start from
+        if ((ufd[3].revents & POLLIN) && frame_export_accept(root_width, root_height))
+            damage_screen();
+
+        // And a new thumbnail table needs every window in it
+        if ((ufd[4].revents & POLLIN) && thumbnails_accept()) {
+            for (size_t i = 0; i < cvector_size(clients); ++i) {
+                clients[i].cold->thumbnail_dirty = true;
+                clients[i].cold->thumbnail_due = 0;
+            }
         }
     }
 
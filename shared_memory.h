@@ -0,0 +1,28 @@
+#ifndef SHARED_MEMORY_H_
+#define SHARED_MEMORY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+/*
+ * The plumbing shared by everything that hands images to other local
+ * processes: memory both the X server and the consumers can see, and the
+ * Unix socket it's passed over.
+ */
+
+// A memfd of `size` bytes, sealed so that nobody it's shared with can
+// shrink it under the others. Returns -1 on failure.
+int shared_memory_create(const char *name, size_t size);
+
+// Lets the server write into `fd` with ShmGetImage
+bool shared_memory_attach(xcb_connection_t *connection, int fd, xcb_shm_seg_t *segment);
+
+// A listening, non-blocking SOCK_SEQPACKET socket at `path`, -1 on failure
+int listen_unix(const char *path);
+
+// Sends `size` bytes of `data` with `fd` attached
+bool send_fd(int socket, int fd, const void *data, size_t size);
+
+#endif /* SHARED_MEMORY_H_ */
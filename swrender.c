@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <X11/Xlib-xcb.h>
+
+#include "cvector.h"
+#include "swrender.h"
+
+#define SW_MAX_THREADS 64
+
+// A worker's share of the tiles. The owner and the workers stealing from it
+// all take the next tile the same way, so nothing but the counter is shared.
+typedef struct Sw_Queue {
+    _Alignas(64) _Atomic size_t next;
+    size_t end;
+} Sw_Queue;
+
+static Display *display;
+static xcb_connection_t *connection;
+static xcb_gcontext_t gc;
+static int depth;
+
+static int thread_count = 1;
+static Sw_Queue queues[SW_MAX_THREADS];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static unsigned long generation;
+static int busy_workers;
+
+static cvector(xcb_shm_get_image_cookie_t) fetches = NULL;
+// Answered once the server has read the last frame pushed
+static xcb_get_input_focus_cookie_t push_done;
+static bool pushing;
+
+// The frame being rendered, only written before the workers are started
+static Sw_Surface *frame;
+static const Sw_Surface *background;
+static const Sw_Layer *layers;
+static int columns, rows;
+static cvector(uint8_t) tile_marks = NULL;
+static cvector(int) jobs = NULL;            // damaged tiles, row by row
+static cvector(bool) job_covered = NULL;    // a solid window hides the background
+static cvector(size_t) job_first = NULL;    // where each tile's draw list starts
+static cvector(int) draw_list = NULL;       // layers to composite, bottom up
+
+static unsigned long parallel_frames;
+static unsigned long serial_frames;
+static unsigned long tiles_rendered;
+static _Atomic unsigned long tiles_stolen;
+static uint64_t render_ns;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static bool intersect(XRectangle *a, const XRectangle *b) {
+    int x0 = a->x > b->x ? a->x : b->x;
+    int y0 = a->y > b->y ? a->y : b->y;
+    int x1 = a->x + a->width < b->x + b->width ? a->x + a->width : b->x + b->width;
+    int y1 = a->y + a->height < b->y + b->height ? a->y + a->height : b->y + b->height;
+    if (x0 >= x1 || y0 >= y1)
+        return false;
+    a->x = x0;
+    a->y = y0;
+    a->width = x1 - x0;
+    a->height = y1 - y0;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Pixels
+
+
+// Multiplies the four channels of `x` by a / 255
+static inline uint32_t scale_pixel(uint32_t x, uint32_t a) {
+    uint32_t rb = (x & 0x00ff00ff) * a + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    uint32_t ag = ((x >> 8) & 0x00ff00ff) * a + 0x00800080;
+    ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+    return rb | ag;
+}
+
+
+static void blend_rect(const Sw_Layer *layer, const XRectangle *r) {
+    const Sw_Surface *surface = layer->surface;
+    for (int y = r->y; y < r->y + r->height; y++) {
+        const uint32_t *src = surface->pixels + (size_t) (y - layer->y) * (surface->stride / 4) +
+            (r->x - layer->x);
+        uint32_t *dst = frame->pixels + (size_t) y * (frame->stride / 4) + r->x;
+        if (layer->alpha == 255 && !layer->has_alpha) {
+            memcpy(dst, src, r->width * 4);
+            continue;
+        }
+        for (int x = 0; x < r->width; x++) {
+            uint32_t s = layer->has_alpha ? src[x] : src[x] | 0xff000000;
+            if (layer->alpha != 255)
+                s = scale_pixel(s, layer->alpha);
+            dst[x] = s + scale_pixel(dst[x], 255 - (s >> 24));
+        }
+    }
+}
+
+
+static XRectangle layer_rect(const Sw_Layer *layer) {
+    XRectangle r = { layer->x, layer->y, layer->surface->width, layer->surface->height };
+    return r;
+}
+
+
+static void render_tile(size_t job) {
+    int tile = jobs[job];
+    XRectangle area = { (tile % columns) * SW_TILE_SIZE, (tile / columns) * SW_TILE_SIZE,
+                        SW_TILE_SIZE, SW_TILE_SIZE };
+    XRectangle screen = { 0, 0, frame->width, frame->height };
+    intersect(&area, &screen);
+
+    if (!job_covered[job]) {
+        for (int y = area.y; y < area.y + area.height; y++) {
+            memcpy(frame->pixels + (size_t) y * (frame->stride / 4) + area.x,
+                   background->pixels + (size_t) y * (background->stride / 4) + area.x,
+                   area.width * 4);
+        }
+    }
+
+    for (size_t i = job_first[job]; i < job_first[job + 1]; i++) {
+        const Sw_Layer *layer = &layers[draw_list[i]];
+        XRectangle r = layer_rect(layer);
+        if (!intersect(&r, &area))
+            continue;
+        if (!layer->clip) {
+            blend_rect(layer, &r);
+            continue;
+        }
+        for (int c = 0; c < layer->clip_count; c++) {
+            XRectangle part = layer->clip[c];
+            if (intersect(&part, &r))
+                blend_rect(layer, &part);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Thread pool
+
+
+// Works through our own queue, then helps whoever is still busy
+static void run_jobs(int self) {
+    for (int i = 0; i < thread_count; i++) {
+        int victim = (self + i) % thread_count;
+        Sw_Queue *queue = &queues[victim];
+        size_t job;
+        while ((job = atomic_fetch_add_explicit(&queue->next, 1, memory_order_relaxed)) < queue->end) {
+            render_tile(job);
+            if (victim != self)
+                atomic_fetch_add_explicit(&tiles_stolen, 1, memory_order_relaxed);
+        }
+    }
+}
+
+
+static void *worker(void *arg) {
+    int self = (intptr_t) arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        while (generation == seen)
+            pthread_cond_wait(&pool_start, &pool_lock);
+        seen = generation;
+        pthread_mutex_unlock(&pool_lock);
+
+        run_jobs(self);
+
+        pthread_mutex_lock(&pool_lock);
+        if (--busy_workers == 0)
+            pthread_cond_signal(&pool_done);
+    }
+    return NULL;
+}
+
+
+bool sw_init(Display *dpy, int threads) {
+    display = dpy;
+    connection = XGetXCBConnection(display);
+    depth = DefaultDepth(display, DefaultScreen(display));
+    gc = xcb_generate_id(connection);
+    xcb_create_gc(connection, gc, DefaultRootWindow(display), 0, NULL);
+
+    if (threads > SW_MAX_THREADS)
+        threads = SW_MAX_THREADS;
+    thread_count = 1;
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, (void *) (intptr_t) i)) {
+            fprintf(stderr, "Can't start render thread %d, using %d\n", i, thread_count);
+            break;
+        }
+        pthread_detach(thread);
+        thread_count++;
+    }
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Surfaces
+
+
+bool sw_surface_create(Sw_Surface *surface, int width, int height) {
+    surface->width = width;
+    surface->height = height;
+    surface->stride = (size_t) width * 4;
+    surface->size = surface->stride * height;
+    if (surface->size == 0)
+        surface->size = 4;
+
+    surface->fd = shared_memory_create("compositor-surface", surface->size);
+    if (surface->fd < 0)
+        return false;
+    surface->pixels = mmap(NULL, surface->size, PROT_READ | PROT_WRITE, MAP_SHARED, surface->fd, 0);
+    if (surface->pixels == MAP_FAILED) {
+        close(surface->fd);
+        return false;
+    }
+    if (!shared_memory_attach(connection, surface->fd, &surface->segment)) {
+        munmap(surface->pixels, surface->size);
+        close(surface->fd);
+        return false;
+    }
+    return true;
+}
+
+
+void sw_surface_free(Sw_Surface *surface) {
+    xcb_shm_detach(connection, surface->segment);
+    munmap(surface->pixels, surface->size);
+    close(surface->fd);
+}
+
+
+void sw_fetch_rows(Sw_Surface *surface, Drawable drawable, int top, int bottom) {
+    if (top < 0)
+        top = 0;
+    if (bottom > surface->height)
+        bottom = surface->height;
+    if (top >= bottom)
+        return;
+    xcb_shm_get_image_cookie_t cookie =
+        xcb_shm_get_image(connection, drawable, 0, top, surface->width, bottom - top, ~0,
+                          XCB_IMAGE_FORMAT_Z_PIXMAP, surface->segment, (size_t) top * surface->stride);
+    cvector_push_back(fetches, cookie);
+}
+
+
+void sw_fetch_wait(void) {
+    for (size_t i = 0; i < cvector_size(fetches); ++i) {
+        xcb_generic_error_t *error = NULL;
+        free(xcb_shm_get_image_reply(connection, fetches[i], &error));
+        free(error);
+    }
+    cvector_clear(fetches);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+// Rendering
+
+
+// Which layers show in each damaged tile. Layers below one that's solid and
+// covers the whole tile are left out, and so is the background.
+static void build_draw_lists(int layer_count) {
+    cvector_clear(job_covered);
+    cvector_clear(job_first);
+    cvector_clear(draw_list);
+    XRectangle screen = { 0, 0, frame->width, frame->height };
+
+    for (size_t job = 0; job < cvector_size(jobs); ++job) {
+        int tile = jobs[job];
+        XRectangle area = { (tile % columns) * SW_TILE_SIZE, (tile / columns) * SW_TILE_SIZE,
+                            SW_TILE_SIZE, SW_TILE_SIZE };
+        intersect(&area, &screen);
+
+        size_t first = cvector_size(draw_list);
+        bool covered = false;
+        for (int i = 0; i < layer_count && !covered; i++) {
+            const Sw_Layer *layer = &layers[i];
+            XRectangle r = layer_rect(layer);
+            if (!intersect(&r, &area))
+                continue;
+            if (layer->clip) {
+                bool shows = false;
+                for (int c = 0; c < layer->clip_count && !shows; c++) {
+                    XRectangle part = layer->clip[c];
+                    shows = intersect(&part, &r);
+                }
+                if (!shows)
+                    continue;
+            }
+            cvector_push_back(draw_list, i);
+            covered = layer->alpha == 255 && !layer->has_alpha && !layer->clip &&
+                r.x == area.x && r.y == area.y && r.width == area.width && r.height == area.height;
+        }
+        // Topmost first so far, they're painted bottom up
+        for (size_t a = first, b = cvector_size(draw_list); a + 1 < b; a++, b--) {
+            int swap = draw_list[a];
+            draw_list[a] = draw_list[b - 1];
+            draw_list[b - 1] = swap;
+        }
+        cvector_push_back(job_first, first);
+        cvector_push_back(job_covered, covered);
+    }
+    cvector_push_back(job_first, cvector_size(draw_list));
+}
+
+
+void sw_render(Sw_Surface *target, const Sw_Surface *back,
+               const Sw_Layer *scene, int layer_count, const XRectangle *rects, int rect_count) {
+    uint64_t start = now_ns();
+    if (pushing) {
+        free(xcb_get_input_focus_reply(connection, push_done, NULL));
+        pushing = false;
+    }
+    frame = target;
+    background = back;
+    layers = scene;
+    columns = (frame->width + SW_TILE_SIZE - 1) / SW_TILE_SIZE;
+    rows = (frame->height + SW_TILE_SIZE - 1) / SW_TILE_SIZE;
+
+    cvector_clear(tile_marks);
+    for (int i = 0; i < columns * rows; i++)
+        cvector_push_back(tile_marks, 0);
+    XRectangle screen = { 0, 0, frame->width, frame->height };
+    for (int i = 0; i < rect_count; i++) {
+        XRectangle r = rects[i];
+        if (!intersect(&r, &screen))
+            continue;
+        for (int y = r.y / SW_TILE_SIZE; y <= (r.y + r.height - 1) / SW_TILE_SIZE; y++) {
+            for (int x = r.x / SW_TILE_SIZE; x <= (r.x + r.width - 1) / SW_TILE_SIZE; x++)
+                tile_marks[y * columns + x] = 1;
+        }
+    }
+    cvector_clear(jobs);
+    for (int i = 0; i < columns * rows; i++) {
+        if (tile_marks[i])
+            cvector_push_back(jobs, i);
+    }
+    size_t job_count = cvector_size(jobs);
+    if (!job_count)
+        return;
+
+    build_draw_lists(layer_count);
+    tiles_rendered += job_count;
+
+    if (thread_count == 1 || job_count < SW_PARALLEL_TILES) {
+        for (size_t job = 0; job < job_count; job++)
+            render_tile(job);
+        serial_frames++;
+        render_ns += now_ns() - start;
+        return;
+    }
+
+    // Neighbouring tiles go to the same worker, they tend to share windows
+    for (int i = 0; i < thread_count; i++) {
+        atomic_store_explicit(&queues[i].next, job_count * i / thread_count, memory_order_relaxed);
+        queues[i].end = job_count * (i + 1) / thread_count;
+    }
+    pthread_mutex_lock(&pool_lock);
+    busy_workers = thread_count - 1;
+    generation++;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+
+    run_jobs(0);
+
+    pthread_mutex_lock(&pool_lock);
+    while (busy_workers)
+        pthread_cond_wait(&pool_done, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    parallel_frames++;
+    render_ns += now_ns() - start;
+}
+
+
+void sw_push(const Sw_Surface *target, Drawable drawable) {
+    // Runs of damaged tiles along a row go up in one request
+    for (size_t i = 0; i < cvector_size(jobs);) {
+        int tile = jobs[i];
+        size_t run = 1;
+        while (i + run < cvector_size(jobs) && jobs[i + run] == tile + (int) run &&
+               (tile + (int) run) % columns != 0)
+            run++;
+
+        XRectangle area = { (tile % columns) * SW_TILE_SIZE, (tile / columns) * SW_TILE_SIZE,
+                            SW_TILE_SIZE * run, SW_TILE_SIZE };
+        XRectangle screen = { 0, 0, target->width, target->height };
+        intersect(&area, &screen);
+        xcb_shm_put_image(connection, drawable, gc, target->width, target->height,
+                          area.x, area.y, area.width, area.height, area.x, area.y,
+                          depth, XCB_IMAGE_FORMAT_Z_PIXMAP, 0, target->segment, 0);
+        i += run;
+    }
+    push_done = xcb_get_input_focus(connection);
+    pushing = true;
+}
+
+
+void sw_dump_stats(void) {
+    unsigned long frames = parallel_frames + serial_frames;
+    fprintf(stderr, "software render: %d threads, %lu frames (%lu in parallel), %lu tiles, "
+            "%lu stolen, %.2f ms a frame\n",
+            thread_count, frames, parallel_frames, tiles_rendered,
+            atomic_load(&tiles_stolen), frames ? render_ns / 1e6 / frames : 0.0);
+}
@@ -0,0 +1,71 @@
+#ifndef SWRENDER_H_
+#define SWRENDER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <xcb/xcb.h>
+
+#include "shared_memory.h"
+
+/*
+ * Compositing on our own cores instead of the X server's single thread, for
+ * servers without acceleration (Xvfb, Xvnc) where XRender is all software
+ * anyway. Window contents are copied into shared memory with MIT-SHM as
+ * they're damaged, the screen is cut into tiles, and the damaged tiles are
+ * composited in parallel and put back into a pixmap on the server.
+ *
+ * Pixels are 32 bit, premultiplied ARGB when there is an alpha channel and
+ * xRGB otherwise.
+ */
+#define SW_TILE_SIZE 64
+// Below this many damaged tiles handing them to the pool costs more than it
+// saves, they're rendered on the calling thread
+#define SW_PARALLEL_TILES 16
+
+typedef struct Sw_Surface {
+    int width, height;
+    size_t stride;
+    uint32_t *pixels;
+    size_t size;
+    int fd;
+    xcb_shm_seg_t segment;
+} Sw_Surface;
+
+// One window as the tile renderer sees it
+typedef struct Sw_Layer {
+    const Sw_Surface *surface;
+    int x, y;                   // of the surface on the screen
+    uint8_t alpha;              // window opacity, 255 for opaque
+    bool has_alpha;             // the surface has an alpha channel
+    const XRectangle *clip;     // on the screen, NULL to show all of the surface
+    int clip_count;
+} Sw_Layer;
+
+// Starts `threads` workers, the calling thread counts as one of them
+bool sw_init(Display *display, int threads);
+
+bool sw_surface_create(Sw_Surface *surface, int width, int height);
+void sw_surface_free(Sw_Surface *surface);
+
+// Queues a copy of rows `top` to `bottom` of `drawable`, which is the size of
+// the surface. Whole rows are copied so they land in place.
+void sw_fetch_rows(Sw_Surface *surface, Drawable drawable, int top, int bottom);
+
+// Waits until the queued copies are done
+void sw_fetch_wait(void);
+
+// Composites the tiles of `frame` touched by `rects`. `layers` are topmost
+// first, `background` is the size of the frame and shows where nothing
+// solid covers it.
+void sw_render(Sw_Surface *frame, const Sw_Surface *background,
+               const Sw_Layer *layers, int layer_count, const XRectangle *rects, int rect_count);
+
+// Puts the tiles the last sw_render changed into `drawable`. The next
+// sw_render waits for the server to be done reading them.
+void sw_push(const Sw_Surface *frame, Drawable drawable);
+
+void sw_dump_stats(void);
+
+#endif /* SWRENDER_H_ */
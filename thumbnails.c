@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <X11/Xlib-xcb.h>
+
+#include "cvector.h"
+#include "thumbnails.h"
+#include "shared_memory.h"
+
+typedef struct Pending_Thumbnail {
+    int index;
+    uint16_t width, height;
+    xcb_shm_get_image_cookie_t cookie;
+} Pending_Thumbnail;
+
+static Display *display;
+static xcb_connection_t *connection;
+static int listen_fd = -1;
+static int thumbnail_size;
+static cvector(int) consumers = NULL;
+
+// The table, while anyone is attached
+static int table_fd = -1;
+static size_t table_size;
+static Thumbnail_Table *table;
+static xcb_shm_seg_t segment;
+static uint64_t sequence;
+
+// Every thumbnail is scaled into this before the server copies it out
+static Pixmap scratch_pixmap;
+static Picture scratch_picture;
+
+static cvector(Pending_Thumbnail) pending = NULL;
+
+static unsigned long thumbnails_made;
+static unsigned long thumbnail_bytes;
+
+
+bool thumbnails_init(Display *dpy, const char *path, int size) {
+    display = dpy;
+    connection = XGetXCBConnection(display);
+    thumbnail_size = size;
+
+    listen_fd = listen_unix(path);
+    return listen_fd >= 0;
+}
+
+
+int thumbnails_listen_fd(void) {
+    return listen_fd;
+}
+
+
+bool thumbnails_active(void) {
+    return !cvector_empty(consumers);
+}
+
+
+static void free_table(void) {
+    if (!table)
+        return;
+    cvector_clear(pending);
+    XRenderFreePicture(display, scratch_picture);
+    XFreePixmap(display, scratch_pixmap);
+    xcb_shm_detach(connection, segment);
+    munmap(table, sizeof(Thumbnail_Table));
+    close(table_fd);
+    table = NULL;
+    table_fd = -1;
+}
+
+
+static bool create_table(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t header = (sizeof(Thumbnail_Table) + page - 1) / page * page;
+    size_t pixels = (size_t) thumbnail_size * thumbnail_size * 4;
+    // Mostly never touched, a memfd only takes memory for what's written
+    table_size = header + pixels * THUMBNAIL_ENTRIES;
+
+    table_fd = shared_memory_create("compositor-thumbnails", table_size);
+    if (table_fd < 0)
+        return false;
+
+    table = mmap(NULL, sizeof(Thumbnail_Table), PROT_READ | PROT_WRITE, MAP_SHARED, table_fd, 0);
+    if (table == MAP_FAILED) {
+        table = NULL;
+        close(table_fd);
+        table_fd = -1;
+        return false;
+    }
+
+    if (!shared_memory_attach(connection, table_fd, &segment)) {
+        fprintf(stderr, "The server can't attach the thumbnail memory\n");
+        munmap(table, sizeof(Thumbnail_Table));
+        table = NULL;
+        close(table_fd);
+        table_fd = -1;
+        return false;
+    }
+
+    table->magic = THUMBNAIL_MAGIC;
+    table->version = THUMBNAIL_VERSION;
+    table->size = thumbnail_size;
+    table->entry_count = THUMBNAIL_ENTRIES;
+    for (int i = 0; i < THUMBNAIL_ENTRIES; i++) {
+        atomic_store(&table->entries[i].sequence, 0);
+        table->entries[i].window = 0;
+        table->entries[i].width = 0;
+        table->entries[i].height = 0;
+        table->entries[i].data_offset = header + pixels * i;
+    }
+
+    XRenderPictFormat *format = XRenderFindStandardFormat(display, PictStandardARGB32);
+    scratch_pixmap = XCreatePixmap(display, DefaultRootWindow(display), thumbnail_size, thumbnail_size, 32);
+    scratch_picture = XRenderCreatePicture(display, scratch_pixmap, format, 0, NULL);
+    return true;
+}
+
+
+bool thumbnails_accept(void) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    bool created = false;
+    if (!table) {
+        if (!create_table()) {
+            close(fd);
+            return false;
+        }
+        created = true;
+    }
+    uint64_t size = table_size;
+    if (!send_fd(fd, table_fd, &size, sizeof(size))) {
+        close(fd);
+        if (cvector_empty(consumers))
+            free_table();
+        return false;
+    }
+    cvector_push_back(consumers, fd);
+    return created;
+}
+
+
+// The entry holding `window`, or the empty one it would go in. -1 if the
+// window isn't there and there's no room.
+static int find_entry(Window window) {
+    int index = window % THUMBNAIL_ENTRIES;
+    for (int i = 0; i < THUMBNAIL_ENTRIES; i++) {
+        Thumbnail_Entry *entry = &table->entries[index];
+        if (entry->window == window || entry->window == 0)
+            return index;
+        index = (index + 1) % THUMBNAIL_ENTRIES;
+    }
+    return -1;
+}
+
+
+bool thumbnails_update(Window window, Picture picture, int width, int height) {
+    if (!table || width <= 0 || height <= 0)
+        return false;
+
+    int index = find_entry(window);
+    if (index < 0)
+        return false;
+    Thumbnail_Entry *entry = &table->entries[index];
+
+    // Keep the aspect ratio, and never scale up
+    double scale = 1.0;
+    if (width > thumbnail_size || height > thumbnail_size)
+        scale = width > height ? (double) thumbnail_size / width : (double) thumbnail_size / height;
+    int w = width * scale + 0.5;
+    int h = height * scale + 0.5;
+    if (w < 1)
+        w = 1;
+    if (h < 1)
+        h = 1;
+
+    // The "good" filter averages every source pixel under a destination
+    // pixel when scaling down, bilinear alone would skip most of them
+    XTransform transform = {{
+        { XDoubleToFixed(1.0 / scale), 0, 0 },
+        { 0, XDoubleToFixed(1.0 / scale), 0 },
+        { 0, 0, XDoubleToFixed(1.0) }
+    }};
+    XRenderSetPictureTransform(display, picture, &transform);
+    XRenderSetPictureFilter(display, picture, FilterGood, NULL, 0);
+    XRenderComposite(display, PictOpSrc, picture, None, scratch_picture,
+                     0, 0, 0, 0, 0, 0, w, h);
+
+    XTransform identity = {{
+        { XDoubleToFixed(1.0), 0, 0 },
+        { 0, XDoubleToFixed(1.0), 0 },
+        { 0, 0, XDoubleToFixed(1.0) }
+    }};
+    XRenderSetPictureTransform(display, picture, &identity);
+    XRenderSetPictureFilter(display, picture, FilterNearest, NULL, 0);
+
+    atomic_store_explicit(&entry->sequence, 0, memory_order_release);
+    entry->window = window;
+
+    // The scratch picture is reused by the next thumbnail, but the server
+    // handles requests in order so this copy is done by then
+    Pending_Thumbnail thumbnail = { index, w, h };
+    thumbnail.cookie = xcb_shm_get_image(connection, scratch_pixmap, 0, 0, w, h, ~0,
+                                         XCB_IMAGE_FORMAT_Z_PIXMAP, segment, entry->data_offset);
+    cvector_push_back(pending, thumbnail);
+    return true;
+}
+
+
+void thumbnails_flush(void) {
+    if (!table || cvector_empty(pending))
+        return;
+
+    static cvector(uint32_t) updated = NULL;
+    cvector_clear(updated);
+    for (size_t i = 0; i < cvector_size(pending); ++i) {
+        Pending_Thumbnail *thumbnail = &pending[i];
+        xcb_generic_error_t *error = NULL;
+        xcb_shm_get_image_reply_t *reply = xcb_shm_get_image_reply(connection, thumbnail->cookie, &error);
+        Thumbnail_Entry *entry = &table->entries[thumbnail->index];
+        if (reply && entry->window) {
+            entry->width = thumbnail->width;
+            entry->height = thumbnail->height;
+            atomic_store_explicit(&entry->sequence, ++sequence, memory_order_release);
+            cvector_push_back(updated, entry->window);
+            thumbnails_made++;
+            thumbnail_bytes += (size_t) thumbnail->width * thumbnail->height * 4;
+        }
+        free(reply);
+        free(error);
+    }
+    cvector_clear(pending);
+
+    // A consumer that's gone is only noticed here
+    for (size_t i = 0; i < cvector_size(consumers);) {
+        bool gone = false;
+        for (size_t j = 0; j < cvector_size(updated) && !gone; ++j) {
+            gone = send(consumers[i], &updated[j], sizeof(uint32_t), MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+                errno != EAGAIN;
+        }
+        if (gone) {
+            close(consumers[i]);
+            cvector_erase(consumers, i);
+            continue;
+        }
+        i++;
+    }
+    if (cvector_empty(consumers))
+        free_table();
+}
+
+
+void thumbnails_remove(Window window) {
+    if (!table)
+        return;
+    int hole = find_entry(window);
+    if (hole < 0 || table->entries[hole].window != window)
+        return;
+
+    // Pull the entries after it back so every window stays reachable from
+    // its home entry without a gap. The pixels stay where they are, the
+    // entries just trade data offsets.
+    for (int index = (hole + 1) % THUMBNAIL_ENTRIES; table->entries[index].window;
+         index = (index + 1) % THUMBNAIL_ENTRIES) {
+        Thumbnail_Entry *entry = &table->entries[index];
+        int home = entry->window % THUMBNAIL_ENTRIES;
+        // Whether home lies cyclically in (hole, index], where it can stay
+        bool stays = hole <= index ? hole < home && home <= index : hole < home || home <= index;
+        if (stays)
+            continue;
+
+        Thumbnail_Entry *target = &table->entries[hole];
+        uint64_t offset = target->data_offset;
+        uint64_t moved = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+        atomic_store_explicit(&target->sequence, 0, memory_order_release);
+        atomic_store_explicit(&entry->sequence, 0, memory_order_release);
+        target->window = entry->window;
+        target->width = entry->width;
+        target->height = entry->height;
+        target->data_offset = entry->data_offset;
+        entry->data_offset = offset;
+        atomic_store_explicit(&target->sequence, moved, memory_order_release);
+        for (size_t i = 0; i < cvector_size(pending); ++i) {
+            if (pending[i].index == index)
+                pending[i].index = hole;
+        }
+        hole = index;
+    }
+
+    Thumbnail_Entry *entry = &table->entries[hole];
+    atomic_store_explicit(&entry->sequence, 0, memory_order_release);
+    entry->window = 0;
+    entry->width = 0;
+    entry->height = 0;
+}
+
+
+void thumbnails_dump_stats(void) {
+    if (listen_fd < 0)
+        return;
+    int used = 0;
+    for (int i = 0; table && i < THUMBNAIL_ENTRIES; i++)
+        used += table->entries[i].window != 0;
+    fprintf(stderr, "thumbnails: %zu consumers, %d windows, %lu made, %lu bytes\n",
+            cvector_size(consumers), used, thumbnails_made, thumbnail_bytes);
+}
@@ -0,0 +1,67 @@
+#ifndef THUMBNAILS_H_
+#define THUMBNAILS_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrender.h>
+
+/*
+ * Downscaled pictures of the windows for task switchers, pagers and docks.
+ * A consumer connects to the thumbnail socket and gets a memfd holding a
+ * table of thumbnails keyed by window, then the XID of every window whose
+ * thumbnail changed as 4 bytes on the socket.
+ *
+ * Entries are found by the window's XID: start at window % entry_count and
+ * step forward until the window or an empty entry (window 0). Thumbnails
+ * are ARGB32, premultiplied, at most size x size and keep the window's
+ * aspect ratio. An entry's sequence is 0 while it's written; a consumer
+ * copies the pixels and checks the sequence didn't change.
+ */
+#define THUMBNAIL_MAGIC 0x424d4854 /* "THMB" */
+#define THUMBNAIL_VERSION 1
+#define THUMBNAIL_ENTRIES 256
+
+typedef struct Thumbnail_Entry {
+    _Atomic uint64_t sequence;
+    uint32_t window;            // 0 if the entry is free
+    uint16_t width, height;
+    uint64_t data_offset;       // of the pixels, from the start of the memfd
+} Thumbnail_Entry;
+
+typedef struct Thumbnail_Table {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              // thumbnails fit in size x size, rows are width * 4 bytes
+    uint32_t entry_count;
+    Thumbnail_Entry entries[THUMBNAIL_ENTRIES];
+} Thumbnail_Table;
+
+// Starts listening on `path`. Returns false if the socket can't be set up.
+bool thumbnails_init(Display *display, const char *path, int size);
+
+// The listening socket, -1 when thumbnails are off
+int thumbnails_listen_fd(void);
+
+// Takes a waiting consumer. Returns true if that created the table, in which
+// case every window needs a thumbnail.
+bool thumbnails_accept(void);
+
+// Thumbnails are only worth making while someone is reading them
+bool thumbnails_active(void);
+
+// Queues a thumbnail of `picture`, `width` x `height`, for `window`. The
+// picture's transform and filter are put back to normal afterwards.
+// Returns false if the table is full.
+bool thumbnails_update(Window window, Picture picture, int width, int height);
+
+// Waits for the queued thumbnails and tells the consumers about them
+void thumbnails_flush(void);
+
+// Frees the entry of a window that's gone
+void thumbnails_remove(Window window);
+
+void thumbnails_dump_stats(void);
+
+#endif /* THUMBNAILS_H_ */